@@ -0,0 +1,812 @@
+// Micro benchmarks of state machine operations.
+//
+// Compile like this:
+// g++ -O2 -D NDEBUG Macho.cpp Benchmark.cpp
+// or, including snapshots:
+// g++ -O2 -D NDEBUG -D MACHO_SNAPSHOTS Macho.cpp Benchmark.cpp
+// or, including the multi-threaded executor:
+// g++ -std=c++11 -O2 -pthread -D NDEBUG -D MACHO_THREADS Macho.cpp Benchmark.cpp
+
+#include "Macho.hpp"
+
+#include <ctime>
+#include <cstdlib>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+#ifdef MACHO_THREADS
+#	include <atomic>
+#	include <chrono>
+#	include <thread>
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Counting heap usage: bytes currently allocated.
+namespace {
+#ifdef MACHO_THREADS
+	atomic<size_t> theAllocated(0);
+#else
+	size_t theAllocated;
+#endif
+
+	// Size is kept in front of memory blocks (keeping alignment).
+	const size_t HEADER = 16;
+}
+
+void * operator new(size_t size) {
+	char * memory = static_cast<char *>(malloc(size + HEADER));
+	if (!memory)
+		throw bad_alloc();
+
+	*reinterpret_cast<size_t *>(memory) = size;
+	theAllocated += size;
+	return memory + HEADER;
+}
+
+void operator delete(void * memory) throw() {
+	if (!memory)
+		return;
+
+	char * block = static_cast<char *>(memory) - HEADER;
+	theAllocated -= *reinterpret_cast<size_t *>(block);
+	free(block);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Timing helpers
+namespace {
+
+	// Keeps the optimizer from removing measured work.
+	volatile long theSink;
+
+	double seconds(clock_t start) {
+		return double(clock() - start) / CLOCKS_PER_SEC;
+	}
+
+	void report(const char * what, double seconds, long operations) {
+		cout << "  " << what << ": " << (seconds * 1e9 / operations) << " ns" << endl;
+	}
+
+} // namespace
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation cost of event objects.
+namespace Events {
+
+	TOPSTATE(Top) {
+		struct Box {
+			Box() : sum(0) {}
+			long sum;
+		};
+
+		STATE(Top)
+
+		virtual void event(long value) { box().sum += value; }
+
+		// Queues an event object (as handlers do).
+		virtual void forward(long value) { dispatch(Macho::Event(&Top::event, value)); }
+	};
+
+	typedef Macho::_Event1<Top, void, long> EventType;
+
+	void run(long count) {
+		cout << "Event objects (per event):" << endl;
+
+		// Before event pools: one heap allocation per event object.
+		clock_t start = clock();
+		for (long i = 0; i < count; ++i) {
+			void * memory = ::operator new(sizeof(EventType));
+			theSink += memory != 0;
+			::operator delete(memory);
+		}
+		report("heap new/delete", seconds(start), count);
+
+		start = clock();
+		for (long i = 0; i < count; ++i) {
+			Macho::IEvent<Top> * event = Macho::Event(&Top::event, i);
+			theSink += event != 0;
+			delete event;
+		}
+		report("pooled Event()/delete", seconds(start), count);
+
+		Macho::Machine<Top> m;
+
+		start = clock();
+		for (long i = 0; i < count; ++i)
+			m->forward(i);
+		report("event queued by handler", seconds(start), count);
+
+		start = clock();
+		for (long i = 0; i < count; ++i)
+			m.dispatch(Macho::Event(&Top::event, i));
+		report("dispatch(Event())", seconds(start), count);
+
+		Macho::InlineEvent<Top> inlineEvent(&Top::event, 1);
+		start = clock();
+		for (long i = 0; i < count; ++i)
+			m.dispatch(inlineEvent);
+		report("dispatch(InlineEvent)", seconds(start), count);
+
+		const long BATCH = 256;
+		Macho::IEvent<Top> * batch[BATCH];
+
+		start = clock();
+		for (long i = 0; i < count; i += BATCH) {
+			for (long j = 0; j < BATCH; ++j)
+				batch[j] = Macho::Event(&Top::event, j);
+			m.dispatchBatch(batch, batch + BATCH);
+		}
+		report("dispatchBatch(Event())", seconds(start), count);
+
+		vector<Macho::InlineEvent<Top> > inlineBatch(BATCH, inlineEvent);
+		for (long j = 0; j < BATCH; ++j)
+			inlineBatch[j] = Macho::InlineEvent<Top>(&Top::event, j);
+
+		start = clock();
+		for (long i = 0; i < count; i += BATCH)
+			m.dispatchBatch(&inlineBatch[0], &inlineBatch[0] + BATCH);
+		report("dispatchBatch(InlineEvent)", seconds(start), count);
+
+		theSink += m.box().sum;
+
+		Macho::PoolStatistics statistics = Macho::Machine<Top>::eventPoolStatistics();
+		cout << "  pool: " << statistics.allocations << " allocations, "
+		     << statistics.reused << " reused, "
+		     << statistics.oversized << " oversized, "
+		     << statistics.cached << " blocks (" << statistics.cachedBytes << " bytes) cached" << endl;
+	}
+
+} // namespace Events
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Cost of transitions depending on depth of state hierarchy.
+namespace Hierarchy {
+
+	TOPSTATE(Top) {
+		STATE(Top)
+
+		virtual void toggle() {}
+	};
+
+	// Two chains of nested states below Top: Level<1, B> ... Level<N, B>.
+	template<int N, int B>
+	struct Level;
+
+	template<int N, int B>
+	struct Super {
+		typedef Level<N - 1, B> T;
+	};
+
+	template<int B>
+	struct Super<1, B> {
+		typedef Top T;
+	};
+
+	template<int N, int B>
+	struct Level : public Macho::Link<Level<N, B>, typename Super<N, B>::T> {
+		TSTATE(Level)
+
+		// Transition from innermost state of one chain to that of the other
+		// leaves and enters N states.
+		virtual void toggle() { setState<Level<N, 1 - B> >(); }
+	};
+
+	template<int N>
+	void run(long count) {
+		Macho::Machine<Top> m(Macho::State<Level<N, 0> >());
+
+		clock_t start = clock();
+		for (long i = 0; i < count; ++i)
+			m->toggle();
+
+		cout << "  depth " << N << ": " << (seconds(start) * 1e9 / count) << " ns" << endl;
+	}
+
+	// Machine construction, visiting both chains, and teardown.
+	template<int N>
+	void lifetime(long count) {
+		clock_t start = clock();
+		for (long i = 0; i < count; ++i) {
+			Macho::Machine<Top> m(Macho::State<Level<N, 0> >());
+			m->toggle();
+		}
+
+		cout << "  depth " << N << ": " << (seconds(start) * 1e9 / count) << " ns" << endl;
+	}
+
+	void run(long count) {
+		cout << "Transitions (per transition):" << endl;
+
+		run<2>(count);
+		run<4>(count / 2);
+		run<8>(count / 4);
+		run<16>(count / 8);
+		run<32>(count / 16);
+		run<64>(count / 32);
+
+		cout << "Machine lifetime (per machine):" << endl;
+
+		lifetime<8>(count / 16);
+		lifetime<64>(count / 128);
+
+		// Small and large subtree, in a machine type of some 250 states.
+		cout << "Clearing deep history (per call):" << endl;
+		Macho::Machine<Top> m(Macho::State<Level<64, 0> >());
+
+		clock_t start = clock();
+		for (long i = 0; i < count; ++i)
+			Level<62, 0>::clearHistoryDeep(m);
+		cout << "  3 states: " << (seconds(start) * 1e9 / count) << " ns" << endl;
+
+		start = clock();
+		for (long i = 0; i < count / 16; ++i)
+			Level<1, 0>::clearHistoryDeep(m);
+		cout << "  64 states: " << (seconds(start) * 1e9 / (count / 16)) << " ns" << endl;
+	}
+
+} // namespace Hierarchy
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Parametrized transitions.
+namespace Parameters {
+
+	TOPSTATE(Top) {
+		struct Box {
+			Box() : sum(0) {}
+			long sum;
+		};
+
+		STATE(Top)
+
+		virtual void toggle(long value) {}
+	};
+
+	SUBSTATE(Left, Top) {
+		STATE(Left)
+
+		virtual void toggle(long value);
+
+	private:
+		void init(long value, long weight) { TOP::box().sum += value * weight; }
+	};
+
+	SUBSTATE(Right, Top) {
+		STATE(Right)
+
+		virtual void toggle(long value) { setState<Left>(value, 2L); }
+
+	private:
+		void init(long value, long weight) { TOP::box().sum += value * weight; }
+	};
+
+	void Left::toggle(long value) { setState<Right>(value, 3L); }
+
+	void run(long count) {
+		cout << "Parametrized transitions (per transition):" << endl;
+
+		Macho::Machine<Top> m(Macho::State<Left>(0L, 0L));
+
+		clock_t start = clock();
+		for (long i = 0; i < count; ++i)
+			m->toggle(i);
+		theSink += m.box().sum;
+
+		report("setState<S>(p1, p2)", seconds(start), count);
+
+		// Aliases copied out of a routing table.
+		vector<Macho::Alias> routes;
+		routes.push_back(Macho::State<Left>(1L, 2L));
+		routes.push_back(Macho::State<Right>(3L, 4L));
+
+		start = clock();
+		for (long i = 0; i < count; ++i) {
+			Macho::Alias route = routes[i & 1];
+			theSink += route.id();
+		}
+
+		report("copy Alias with State<S>(p1, p2)", seconds(start), count);
+	}
+
+} // namespace Parameters
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Many small machines: individual machine objects against a machine pool.
+namespace Sessions {
+
+	TOPSTATE(Top) {
+		struct Box {
+			Box() : events(0) {}
+			long events;
+		};
+
+		STATE(Top)
+
+		virtual void toggle() { ++box().events; }
+		virtual void pause() {}
+
+	private:
+		void init();
+	};
+
+	SUBSTATE(Idle, Top) {
+		STATE(Idle)
+
+		virtual void toggle();
+	};
+
+	SUBSTATE(Active, Top) {
+		STATE(Active)
+		HISTORY()
+
+		virtual void pause();
+
+	private:
+		void init();
+	};
+
+	SUBSTATE(Receiving, Active) {
+		STATE(Receiving)
+
+		virtual void toggle();
+	};
+
+	SUBSTATE(Sending, Active) {
+		STATE(Sending)
+
+		virtual void toggle();
+	};
+
+	void Top::init() { setState<Idle>(); }
+	void Idle::toggle() { TOP::toggle(); setStateHistory<Active>(); }
+	void Active::init() { setState<Receiving>(); }
+	void Active::pause() { setState<Idle>(); }
+	void Receiving::toggle() { TOP::toggle(); setState<Sending>(); }
+	void Sending::toggle() { TOP::toggle(); setState<Receiving>(); }
+
+	void run(long machines, long events) {
+		cout << "Sessions (" << machines << " machines):" << endl;
+
+		// Individual machine objects.
+		{
+			size_t allocated = theAllocated;
+			vector<Macho::Machine<Top> *> sessions;
+			sessions.reserve(machines);
+			for (long i = 0; i < machines; ++i)
+				sessions.push_back(new Macho::Machine<Top>);
+
+			cout << "  Machine<TOP>: " << double(theAllocated - allocated) / machines << " bytes per machine" << endl;
+
+			clock_t start = clock();
+			for (long i = 0; i < events; ++i) {
+				Macho::Machine<Top> & m = *sessions[i % machines];
+				m.dispatch(Macho::Event(i % 7 ? &Top::toggle : &Top::pause));
+			}
+			report("Machine<TOP> dispatch", seconds(start), events);
+
+			for (long i = 0; i < machines; ++i)
+				delete sessions[i];
+		}
+
+		// Machine pool.
+		{
+			size_t allocated = theAllocated;
+			Macho::MachinePool<Top> pool;
+			vector<Macho::MachinePool<Top>::Handle> sessions;
+			sessions.reserve(machines);
+			size_t reserved = sessions.capacity() * sizeof(Macho::MachinePool<Top>::Handle);
+			for (long i = 0; i < machines; ++i)
+				sessions.push_back(pool.add());
+
+			cout << "  MachinePool<TOP>: " << double(theAllocated - allocated - reserved) / machines << " bytes per machine" << endl;
+
+			clock_t start = clock();
+			for (long i = 0; i < events; ++i)
+				pool.dispatch(sessions[i % machines], Macho::Event(i % 7 ? &Top::toggle : &Top::pause));
+			report("MachinePool<TOP> dispatch", seconds(start), events);
+
+			// Machines in a state: scanning all of them against the index.
+			const long queries = 100;
+			start = clock();
+			for (long q = 0; q < queries; ++q) {
+				long count = 0;
+				for (long i = 0; i < machines; ++i)
+					count += pool.isCurrent<Active>(sessions[i]);
+				theSink += count;
+			}
+			report("scan isCurrent<S> over pool", seconds(start), queries);
+
+			start = clock();
+			for (long q = 0; q < queries; ++q)
+				theSink += pool.count<Active>();
+			report("pool.count<S>()", seconds(start), queries);
+
+			// Event to every machine in a state: handle order against grouped.
+			const long rounds = 10;
+			long reached = 0;
+			start = clock();
+			for (long r = 0; r < rounds; ++r) {
+				for (long i = 0; i < machines; ++i) {
+					if (pool.isCurrent<Active>(sessions[i])) {
+						pool.dispatch(sessions[i], Macho::Event(&Top::toggle));
+						++reached;
+					}
+				}
+			}
+			report("dispatch to Active in handle order", seconds(start), reached);
+
+			Macho::InlineEvent<Top> toggle(&Top::toggle);
+			reached = 0;
+			start = clock();
+			for (long r = 0; r < rounds; ++r)
+				reached += pool.broadcast<Active>(toggle);
+			report("pool.broadcast<Active>()", seconds(start), reached);
+		}
+
+		// Top box published for other threads after each step.
+		{
+			Macho::Machine<Top> m;
+			clock_t start = clock();
+			for (long i = 0; i < events; ++i)
+				m.dispatch(Macho::Event(i % 7 ? &Top::toggle : &Top::pause));
+			report("dispatch", seconds(start), events);
+
+			Macho::PublishedBox<Top> published(m);
+			start = clock();
+			for (long i = 0; i < events; ++i)
+				m.dispatch(Macho::Event(i % 7 ? &Top::toggle : &Top::pause));
+			report("dispatch, box published", seconds(start), events);
+
+			start = clock();
+			for (long i = 0; i < events; ++i)
+				theSink += published.get().events;
+			report("PublishedBox::get()", seconds(start), events);
+		}
+	}
+
+} // namespace Sessions
+
+
+#ifdef MACHO_SNAPSHOTS
+////////////////////////////////////////////////////////////////////////////////
+// Undo by snapshots: large document box, small edits.
+namespace Snapshots {
+
+	TOPSTATE(Top) {
+		struct Box {
+			Box() { for (int i = 0; i < SIZE; ++i) text[i] = 0; }
+			enum { SIZE = 4096 };
+			char text[SIZE];
+		};
+
+		STATE(Top)
+
+		virtual void type(long position) {}
+		virtual void select(long position) {}
+	};
+
+	SUBSTATE(Editing, Top) {
+		struct Box {
+			Box() : cursor(0) {}
+			long cursor;
+		};
+
+		STATE(Editing)
+
+		virtual void type(long position) { TOP::box().text[position % TOP::Box::SIZE] = 'x'; }
+		virtual void select(long position) { box().cursor = position; }
+	};
+
+	// Separate machine type: chain of nested states with boxes, Section<1>
+	// ... Section<N>.
+	TOPSTATE(Document) {
+		STATE(Document)
+
+		virtual void select(long position) {}
+	};
+
+	template<int N>
+	struct Section;
+
+	template<int N>
+	struct Outer {
+		typedef Section<N - 1> T;
+	};
+
+	template<>
+	struct Outer<1> {
+		typedef Document T;
+	};
+
+	template<int N>
+	struct Section : public Macho::Link<Section<N>, typename Outer<N>::T> {
+		struct Box {
+			Box() : cursor(0) {}
+			long cursor;
+		};
+
+		TSTATE(Section)
+
+		virtual void select(long position) { box().cursor = position; }
+	};
+
+	void run(long count) {
+		cout << "Snapshots of machine with 4 KB box (per snapshot):" << endl;
+
+		Macho::Machine<Top> m(Macho::State<Editing>());
+
+		clock_t start = clock();
+		for (long i = 0; i < count; ++i) {
+			Macho::Snapshot<Top> s(m);
+			theSink += i;
+		}
+
+		report("take snapshot", seconds(start), count);
+
+		// Only the small box is changed after the snapshot.
+		start = clock();
+		for (long i = 0; i < count; ++i) {
+			Macho::Snapshot<Top> s(m);
+			m->select(i);
+			m = s;
+		}
+
+		report("snapshot, change small box, restore", seconds(start), count);
+
+		start = clock();
+		for (long i = 0; i < count; ++i) {
+			Macho::Snapshot<Top> s(m);
+			m->type(i);
+			m = s;
+		}
+		theSink += m.box().text[0];
+
+		report("snapshot, change large box, restore", seconds(start), count);
+
+		// Checkpoints of machine with 64 active boxes, one changing.
+		Macho::Machine<Document> deep(Macho::State<Section<64> >());
+		vector<Macho::Snapshot<Document> *> checkpoints;
+		long checkpointCount = count / 10;
+
+		start = clock();
+		for (long i = 0; i < checkpointCount; ++i) {
+			deep->select(i);
+			checkpoints.push_back(new Macho::Snapshot<Document>(deep));
+		}
+
+		report("checkpoint of 64 boxes", seconds(start), checkpointCount);
+
+		start = clock();
+		for (long i = 0; i < checkpointCount; ++i) {
+			deep->select(i);
+			checkpoints.push_back(new Macho::Snapshot<Document>(deep, *checkpoints.back()));
+		}
+
+		report("delta checkpoint of 64 boxes", seconds(start), checkpointCount);
+
+		// Deltas first: they need their bases.
+		while (!checkpoints.empty()) {
+			delete checkpoints.back();
+			checkpoints.pop_back();
+		}
+	}
+
+} // namespace Snapshots
+#endif
+
+
+#ifdef MACHO_THREADS
+////////////////////////////////////////////////////////////////////////////////
+// Throughput of an executor with 1 to N worker threads, running microwave
+// ovens (see Microwave.cpp) that compute a bit while cooking. Then sharding
+// against work stealing with most events going to machines of one shard.
+namespace Ovens {
+
+	TOPSTATE(Top) {
+		struct Box {
+			Box() : timer(0), heat(1.0) {}
+			int timer;
+			double heat;
+		};
+
+		STATE(Top)
+
+		virtual void open() {}
+		virtual void close() {}
+		virtual void minute() {}
+		virtual void start() {}
+		virtual void stop() {}
+		virtual void tick() {}
+
+	private:
+		void init();
+	};
+
+	SUBSTATE(Disabled, Top) {
+		STATE(Disabled)
+
+		virtual void close();
+	};
+
+	SUBSTATE(Operational, Top) {
+		STATE(Operational)
+		DEEPHISTORY()
+
+		virtual void open();
+		virtual void stop();
+
+	private:
+		void init();
+	};
+
+	SUBSTATE(Idle, Operational) {
+		STATE(Idle)
+
+		virtual void minute();
+
+	private:
+		void entry();
+	};
+
+	SUBSTATE(Programmed, Operational) {
+		STATE(Programmed)
+
+		virtual void minute();
+		virtual void start();
+	};
+
+	SUBSTATE(Cooking, Programmed) {
+		STATE(Cooking)
+
+		virtual void tick();
+	};
+
+	void Top::init() { setState<Operational>(); }
+	void Disabled::close() { setStateHistory<Operational>(); }
+	void Operational::init() { setState<Idle>(); }
+	void Operational::open() { setState<Disabled>(); }
+	void Operational::stop() { setState<Idle>(); }
+	void Idle::entry() { TOP::box().timer = 0; }
+	void Idle::minute() { setState<Programmed>(); dispatch(Macho::Event(&TOP::minute)); }
+	void Programmed::minute() { ++TOP::box().timer; }
+	void Programmed::start() { setState<Cooking>(); }
+
+	void Cooking::tick() {
+		// Heating simulation.
+		TOP::Box & box = TOP::box();
+		for (int i = 0; i < 100; ++i)
+			box.heat = box.heat * 1.0001 + 0.5 / (box.heat + i);
+
+		if (--box.timer == 0)
+			setState<Idle>();
+	}
+
+	// Program, cook (with a pause) and finish.
+	void (Top::*theProgram[])() = {
+		&Top::minute, &Top::minute, &Top::start, &Top::tick, &Top::open,
+		&Top::close, &Top::tick, &Top::minute, &Top::tick, &Top::tick
+	};
+
+	const long PROGRAM = sizeof(theProgram) / sizeof(theProgram[0]);
+
+	void produce(Macho::Executor<Top> * executor, long first, long machines, long rounds) {
+		for (long r = 0; r < rounds; ++r)
+			for (long i = 0; i < PROGRAM; ++i)
+				for (long key = first; key < machines; key += 2)
+					executor->post(key, Macho::Event(theProgram[i]));
+	}
+
+	void skewed(unsigned int threads, long events);
+
+	void run(long machines, long events) {
+		unsigned int cores = thread::hardware_concurrency();
+		cout << "Ovens (" << machines << " machines, " << cores << " cores):" << endl;
+
+		const long rounds = events / (machines * PROGRAM);
+		double base = 0;
+
+		for (unsigned int threads = 1; threads <= (cores > 8 ? cores : 8); threads *= 2) {
+			Macho::Executor<Top> executor(threads);
+			for (long key = 0; key < machines; ++key)
+				executor.add(key);
+			executor.wait();
+
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			thread p1(produce, &executor, 0, machines, rounds);
+			thread p2(produce, &executor, 1, machines, rounds);
+			p1.join();
+			p2.join();
+			executor.wait();
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			if (threads == 1)
+				base = seconds;
+
+			cout << "  " << threads << " threads: " << (seconds * 1e9 / (rounds * machines * PROGRAM))
+				 << " ns per event, speedup " << base / seconds << endl;
+			theSink += executor.count<Idle>();
+		}
+
+		skewed(cores > 4 ? cores : 4, events / 4);
+	}
+
+	// Machine getting the next event: nine out of ten go to the machines of
+	// the first shard (and home worker).
+	long target(long i, long machines, unsigned int threads) {
+		long hot = (i * 7) % (machines / threads) * threads;
+		return i % 10 ? hot : (i * 13) % machines;
+	}
+
+	void skewed(unsigned int threads, long events) {
+		const long machines = 64;
+		cout << "Ovens, skewed load (" << machines << " machines, " << threads << " threads):" << endl;
+
+		{
+			Macho::Executor<Top> executor(threads);
+			for (long key = 0; key < machines; ++key)
+				executor.add(key);
+			executor.wait();
+
+			long next[machines] = { 0 };
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			for (long i = 0; i < events; ++i) {
+				long key = target(i, machines, threads);
+				executor.post(key, Macho::Event(theProgram[next[key]++ % PROGRAM]));
+			}
+			executor.wait();
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			cout << "  Executor (sharded): " << (seconds * 1e9 / events) << " ns per event" << endl;
+		}
+
+		{
+			Macho::Scheduler<Top> scheduler(threads);
+			vector<Macho::Scheduler<Top>::Handle> handles;
+			for (long key = 0; key < machines; ++key)
+				handles.push_back(scheduler.add());
+
+			long next[machines] = { 0 };
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			for (long i = 0; i < events; ++i) {
+				long key = target(i, machines, threads);
+				Macho::IEvent<Top> * event = Macho::Event(theProgram[next[key]++ % PROGRAM]);
+				while (!scheduler.post(handles[key], event))
+					this_thread::yield();
+			}
+			scheduler.wait();
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			cout << "  Scheduler (work stealing): " << (seconds * 1e9 / events) << " ns per event" << endl;
+
+			for (unsigned int w = 0; w < threads; ++w) {
+				Macho::Scheduler<Top>::Statistics statistics = scheduler.statistics(w);
+				cout << "    worker " << w << ": " << statistics.runs << " runs, " << statistics.steals
+					 << " steals, deque depth up to " << statistics.maxDepth << endl;
+			}
+		}
+	}
+
+} // namespace Ovens
+#endif
+
+
+int main() {
+	const long count = 5000000;
+
+	Events::run(count);
+	Hierarchy::run(count);
+	Parameters::run(count);
+	Sessions::run(100000, count);
+#ifdef MACHO_SNAPSHOTS
+	Snapshots::run(count / 10);
+#endif
+#ifdef MACHO_THREADS
+	Ovens::run(10000, count);
+#endif
+
+	return 0;
+}
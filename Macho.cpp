@@ -14,6 +14,9 @@
 // See Macho.hpp for more information.
 
 #include "Macho.hpp"
+
+#include <cstring>
+
 using namespace Macho;
 
 
@@ -52,16 +55,157 @@ void Macho::_deleteBox<_EmptyBox>(void * & box, void * & place) {
 
 #ifdef MACHO_SNAPSHOTS
 template<>
-void * Macho::_cloneBox<_EmptyBox>(void * other) {
+void * Macho::_cloneBox<_EmptyBox>(const void * other, void * & place) {
 	return &_EmptyBox::theEmptyBox;
 }
 #endif
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Implementation for _KeyTable
+_KeyTable::_KeyTable()
+	: myKeys(0)
+	, myNames(0)
+	, myOffsets(0)
+	, myArenaSize(_RootInstance::arenaSize())	// Root comes first
+	, myPreorder(0)
+	, myPositions(0)
+	, mySubtrees(0)
+	, mySize(0)
+	, myCount(0)
+{}
+
+_KeyTable::~_KeyTable() {
+	delete[] myKeys;
+	delete[] myNames;
+	delete[] myOffsets;
+	delete[] myPreorder;
+	delete[] myPositions;
+	delete[] mySubtrees;
+}
+
+void _KeyTable::insert(ID id, KeyFn key, NameFn name, std::size_t size) {
+	if (id >= mySize) {
+		ID size = mySize ? mySize : 16;
+		while (size <= id)
+			size *= 2;
+
+		KeyFn * keys = new KeyFn[size];
+		Name * names = new Name[size];
+		std::size_t * offsets = new std::size_t[size];
+		for (ID i = 0; i < size; ++i) {
+			keys[i] = i < mySize ? myKeys[i] : 0;
+			offsets[i] = i < mySize ? myOffsets[i] : 0;
+		}
+		for (ID i = 0; i < myCount; ++i)
+			names[i] = myNames[i];
+
+		delete[] myKeys;
+		delete[] myNames;
+		delete[] myOffsets;
+		myKeys = keys;
+		myNames = names;
+		myOffsets = offsets;
+		mySize = size;
+	}
+
+	myKeys[id] = key;
+
+	myOffsets[id] = myArenaSize;
+	myArenaSize += size;
+
+	// Insertion sort: behind states of same name.
+	ID i = myCount++;
+	for (; i > 0 && std::strcmp(myNames[i - 1].name(), name()) > 0; --i)
+		myNames[i] = myNames[i - 1];
+
+	myNames[i].name = name;
+	myNames[i].id = id;
+}
+
+const _KeyTable & _KeyTable::order() {
+	// Root (ID 0) and states 1 to myCount.
+	ID count = myCount + 1;
+
+	ID * parents = new ID[count];
+	ID * depths = new ID[count];
+	ID * next = new ID[count];
+	delete[] myPreorder;
+	delete[] myPositions;
+	delete[] mySubtrees;
+	myPreorder = new ID[count];
+	myPositions = new ID[count];
+	mySubtrees = new ID[count];
+
+	// Subtree sizes: every state counts for all its superstates.
+	ID deepest = 0;
+	for (ID id = 0; id < count; ++id)
+		mySubtrees[id] = 1;
+	mySubtrees[0] = count;
+
+	for (ID id = 1; id < count; ++id) {
+		const _KeyData * key = static_cast<const _KeyData *>(find(id));
+		assert(key);
+
+		parents[id] = key->depth ? key->path[key->depth - 1]->id : 0;
+		depths[id] = key->depth;
+		if (key->depth > deepest)
+			deepest = key->depth;
+
+		for (ID level = 0; level < key->depth; ++level)
+			++mySubtrees[key->path[level]->id];
+	}
+
+	// Superstates first: substates are placed one after another behind
+	// their superstate.
+	myPositions[0] = 0;
+	next[0] = 1;
+	for (ID depth = 0; depth <= deepest; ++depth) {
+		for (ID id = 1; id < count; ++id) {
+			if (depths[id] != depth)
+				continue;
+
+			myPositions[id] = next[parents[id]];
+			next[parents[id]] += mySubtrees[id];
+			next[id] = myPositions[id] + 1;
+		}
+	}
+
+	for (ID id = 0; id < count; ++id)
+		myPreorder[myPositions[id]] = id;
+
+	delete[] parents;
+	delete[] depths;
+	delete[] next;
+
+	return *this;
+}
+
+Key _KeyTable::find(const char * name) const {
+	assert(name);
+
+	// Binary search for first entry not before 'name'.
+	ID first = 0;
+	ID last = myCount;
+	while (first < last) {
+		ID middle = first + (last - first) / 2;
+		if (std::strcmp(myNames[middle].name(), name) < 0)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+
+	if (first < myCount && std::strcmp(myNames[first].name(), name) == 0)
+		return find(myNames[first].id);
+
+	return 0;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Implementation for Alias
 void Alias::setState(_MachineBase & machine) const {
-	machine.setPendingState(key()->instanceGenerator(machine), myInitializer->clone());
+	machine.setPendingState(key()->instanceGenerator(machine), machine.createInitializer(*myInitializer));
 }
 
 
@@ -71,135 +215,296 @@ _StateInstance & _StateSpecification::_getInstance(_MachineBase & machine) {
 	// Look first in machine for existing StateInstance.
 	_StateInstance * & instance = machine.getInstance(0);
 	if (!instance)
-		instance = new _RootInstance(machine, 0);
+		instance = new (machine.arena(0)) _RootInstance(machine, 0);
 
 	return *instance;
 }
 
 void _StateSpecification::_shutdown() {
-	_myStateInstance.machine().shutdown();
+	_machine().shutdown();
 }
 
 void _StateSpecification::_restore(_StateInstance & current) {
-	_myStateInstance.machine().myCurrentState = &current;
+	_machine().myCurrentState = &current;
 }
 
 void _StateSpecification::setState(const Alias & state) {
-	state.setState(_myStateInstance.machine());
+	state.setState(_machine());
 }
 
 #ifdef MACHO_SNAPSHOTS
 void _StateSpecification::setState(_StateInstance & current) {
-	_myStateInstance.machine().setPendingState(current, &_theDefaultInitializer);
+	_machine().setPendingState(current, &_theDefaultInitializer);
 }
 #endif
 
 
 ////////////////////////////////////////////////////////////////////////////////
 // StateInstance implementation
-_StateInstance::_StateInstance(_MachineBase & machine, _StateInstance * parent)
+_StateInstance::_StateInstance(_MachineBase & machine, _StateInstance * parent, const _KeyData * key)
 	: myMachine(machine)
+	, myKeyData(key)
+	, myID(key ? key->id : 0)
 	, mySpecification(0)
-	, myHistory(0)
 	, myParent(parent)
-	, myBox(0)
-	, myBoxPlace(0)
-{}
+{
+	boxSlot() = 0;
+	boxPlace() = 0;
+#ifdef MACHO_SNAPSHOTS
+	shareSlot() = 0;
+#endif
+	setHistory(0);
+}
 
 _StateInstance::~_StateInstance() {
-	if (myBoxPlace)
-		::operator delete(myBoxPlace);
+	void * & place = boxPlace();
+	if (place) {
+		::operator delete(place);
+		place = 0;
+	}
 
-	delete mySpecification;
+#ifndef MACHO_FLYWEIGHT
+	// Lives in machine's arena.
+	mySpecification->~_StateSpecification();
+#endif
 }
 
-void _StateInstance::entry(_StateInstance & previous, bool first) {
-	// Only Root has no parent
-	if (!myParent)
-		return;
+ID _StateInstance::commonLevels(const _StateInstance & next) const {
+	// Root is never entered or left.
+	if (!myKeyData || !next.myKeyData)
+		return 0;
 
-	// first entry or previous state is not substate -> perform entry
-	if (first || !previous.isChild(*this)) {
-		myParent->entry(previous, false);
+	// Transition to superstate (or self transition)
+	if (isChild(next))
+		return next.myKeyData->depth;
 
-		createBox();
+	// Compare paths from top state down to least common ancestor.
+	const _KeyData * const * path = myKeyData->path;
+	const _KeyData * const * nextPath = next.myKeyData->path;
+	ID levels = next.myKeyData->depth < myKeyData->depth ? next.myKeyData->depth : myKeyData->depth;
 
-		MACHO_TRC2(name(), "Entry");
-		mySpecification->entry();
-	}
+	ID common = 0;
+	while (common <= levels && path[common] == nextPath[common])
+		++common;
+
+	return common;
 }
 
-void _StateInstance::exit(_StateInstance & next) {
-	// Only Root has no parent
-	if (!myParent)
-		return;
+void _StateInstance::entry(ID kept) {
+	// Root (and kept superstates) have no entry.
+	// Enter from outermost state down to this one, along path of keys.
+	ID levels = this->levels();
+	for (ID level = kept; level < levels; ++level) {
+		// Superstate instances are always created before their substates.
+		_StateInstance * state = myMachine.getInstance(myKeyData->path[level]->id);
+		assert(state);
 
-	// self transition or next state is not substate -> perform exit
-	if (this == &next || !next.isChild(*this)) {
-		MACHO_TRC2(name(), "Exit");
-		mySpecification->exit();
+		state->createBox();
+
+		MACHO_TRC2(state->name(), "Entry");
+		state->mySpecification->entry();
+	}
+}
+
+void _StateInstance::exit(ID kept) {
+	// Root (and kept superstates) have no exit.
+	// Exit from this state up to outermost state left.
+	for (_StateInstance * state = this; state->levels() > kept; state = state->myParent) {
+		MACHO_TRC2(state->name(), "Exit");
+		state->mySpecification->exit();
 
 		// EmptyBox should be most common box, so optimize for this case.
-		if (myBox != &_EmptyBox::theEmptyBox)
-			mySpecification->_deleteBox(*this);
+		if (state->boxSlot() != &_EmptyBox::theEmptyBox)
+			state->mySpecification->_deleteBox(*state);
+	}
+}
 
-		myParent->exit(next);
+void _StateInstance::setBox(void * box) {
+	assert(!boxSlot());
+
+	void * & place = boxPlace();
+	if (place) {
+		// Free cached memory of previously used box.
+		::operator delete(place);
+		place = 0;
 	}
+
+	boxSlot() = box;
+#ifdef MACHO_SNAPSHOTS
+	changed();
+#endif
 }
 
 void _StateInstance::init(bool history) {
-	if (history && myHistory) {
-		MACHO_TRC3(name(), "History transition to", myHistory->name());
-		myMachine.setPendingState(*myHistory, &_theDefaultInitializer);
+	_StateInstance * historyState = this->history();
+
+	if (history && historyState) {
+		MACHO_TRC3(name(), "History transition to", historyState->name());
+		myMachine.setPendingState(*historyState, &_theDefaultInitializer);
 	} else {
 		MACHO_TRC2(name(), "Init");
 		mySpecification->init();
 	}
 
-	myHistory = 0;
+	setHistory(0);
 }
 
 #ifdef MACHO_SNAPSHOTS
-void _StateInstance::copy(_StateInstance & original) {
-	if (original.myHistory) {
-		_StateInstance * history = myMachine.getInstance(original.myHistory->id());
-		assert(history);
-		setHistory(history);
-	}
+bool _StateInstance::dropBox() {
+	_SharedBox * & share = shareSlot();
+	if (!share)
+		return false;
 
-	if (original.myBox)
-		cloneBox(original.myBox);
+	// Snapshots keep the box.
+	share->release();
+	share = 0;
+	boxSlot() = 0;
+
+	return true;
 }
 
-_StateInstance * _StateInstance::clone(_MachineBase & newMachine) {
-	assert(!newMachine.getInstance(id()));
+void _StateInstance::restoreBox(void * box, _SharedBox * share) {
+	void * & slot = boxSlot();
+	if (slot == box)
+		return;
+
+	// Box memory is kept for the next copy of a shared box.
+	if (slot && slot != &_EmptyBox::theEmptyBox)
+		deleteBox();
+	slot = 0;
 
-	_StateInstance * parent = 0;
-	if (myParent)
-		// Tell other machine to clone parent first.
-		parent = newMachine.createClone(myParent->id(), myParent);
+	assert(!shareSlot());
+	slot = box;
+	if (share) {
+		++share->references;
+		shareSlot() = share;
+	}
 
-	_StateInstance * clone = create(newMachine, parent);
-	return clone;
+	// Memory is only kept for a shared box.
+	assert(!boxPlace() || shareSlot());
 }
 #endif
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Implementation for _EventPool
+PoolStatistics _EventPool::statistics() const {
+	PoolStatistics statistics = { myAllocations, myReused, myOversized, 0, 0 };
+
+	for (unsigned int i = 0; i < CLASSES; ++i) {
+		statistics.cached += myCached[i];
+		statistics.cachedBytes += myCached[i] * (i + 1) * GRANULARITY;
+	}
+
+	return statistics;
+}
+
+void _EventPool::release() {
+	for (unsigned int i = 0; i < CLASSES; ++i) {
+		while (Block * block = myBlocks[i]) {
+			myBlocks[i] = block->next;
+			::operator delete(block);
+		}
+		myCached[i] = 0;
+	}
+
+	myReleased = true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Implementation for _EventQueue
+_EventQueue::_EventQueue(unsigned long size)
+	: myCells(new Cell[size])
+	, myMask(size - 1)
+	, myPushPosition(0)
+	, myPopPosition(0)
+{
+	assert(size > 0 && (size & myMask) == 0 && "Queue size must be a power of two!");
+
+	// Sequence equal to position marks a free cell.
+	for (unsigned long i = 0; i < size; ++i)
+		myCells[i].sequence.set(i);
+}
+
+_EventQueue::~_EventQueue() {
+	while (_IEventBase * event = pop())
+		delete event;
+
+	delete[] myCells;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Implementation for _EventFifo
+_EventFifo::~_EventFifo() {
+	while (_IEventBase * event = pop())
+		delete event;
+
+	delete[] myEvents;
+}
+
+void _EventFifo::grow() {
+	unsigned long capacity = myCapacity ? 2 * myCapacity : 8;
+	_IEventBase ** events = new _IEventBase *[capacity];
+
+	for (unsigned long i = 0; i < myCount; ++i)
+		events[i] = myEvents[(myFirst + i) & (myCapacity - 1)];
+
+	delete[] myEvents;
+	myEvents = events;
+	myCapacity = capacity;
+	myFirst = 0;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Base class for Machine objects.
-_MachineBase::_MachineBase()
+_MachineBase::_MachineBase(unsigned long queueSize)
 	: myCurrentState(0)
 	, myPendingState(0)
 	, myPendingInit(0)
 	, myPendingBox(0)	// Deprecated!
-	, myPendingEvent(0)
-{}
+	, myEvents(queueSize)
+	, myInTransition(false)
+#ifdef MACHO_SNAPSHOTS
+	, myKeepEvents(false)
+#endif
+	, myInstances(0)
+	, myArena(0)
+	, myBoxes(0)
+	, myBoxPlaces(0)
+	, myHistories(0)
+#ifdef MACHO_SNAPSHOTS
+	, myShares(0)
+	, myChanged(0)
+	, myChanges(0)
+	, myChangeCount(0)
+	, myGenerations(0)
+	, myLatestGeneration(0)
+	, myLatestMachine(0)
+#endif
+	, myPublishedState(0)
+	, myPublications(0)
+	, myBoxPublisher(0)
+{
+	myPlacedInitializers[0] = 0;
+	myPlacedInitializers[1] = 0;
+}
 
 _MachineBase::~_MachineBase() {
 	assert(!myPendingInit);
 
 	delete[] myInstances;
-	delete myPendingEvent;
+	::operator delete(myArena);
+	delete[] myBoxes;
+	delete[] myBoxPlaces;
+	delete[] myHistories;
+#ifdef MACHO_SNAPSHOTS
+	delete[] myShares;
+	delete[] myChanged;
+	delete[] myChanges;
+#endif
 }
 
 Alias _MachineBase::currentState() const {
@@ -239,130 +544,154 @@ void _MachineBase::shutdown() {
 
 	MACHO_TRC1("Shutting down Machine");
 
+	// Events still queued would reach Root state: drop them (unless kept
+	// for the state of a snapshot being restored).
+#ifdef MACHO_SNAPSHOTS
+	if (!myKeepEvents)
+#endif
+	{
+		while (_IEventBase * event = myDispatched.pop())
+			delete event;
+		while (_IEventBase * event = myEvents.pop())
+			delete event;
+	}
+
 	// Performs exit actions by going to Root (=StateSpecification) state.
-	setState(_StateSpecification::_getInstance(*this), &_theDefaultInitializer);
+	// Events are never dispatched to Root.
+	setPendingState(_StateSpecification::_getInstance(*this), &_theDefaultInitializer);
+	transit();
+	publish();
 
 	myCurrentState = 0;
 }
 
-void _MachineBase::allocate(unsigned int count) {
+void _MachineBase::allocate(unsigned int count, std::size_t arenaSize) {
 	myInstances = new _StateInstance *[count];
-	for (unsigned int i = 0; i < count; ++i)
+	myBoxes = new void *[count];
+	myBoxPlaces = new void *[count];
+	myHistories = new _HistoryID[count];
+#ifdef MACHO_SNAPSHOTS
+	myShares = new _SharedBox *[count];
+	myChanges = new ID[count];
+
+	unsigned int words = (count + BITS - 1) / BITS;
+	myChanged = new unsigned long[words];
+	for (unsigned int i = 0; i < words; ++i)
+		myChanged[i] = 0;
+#endif
+	for (unsigned int i = 0; i < count; ++i) {
 		myInstances[i] = 0;
+		myBoxes[i] = 0;
+		myBoxPlaces[i] = 0;
+		myHistories[i] = 0;
+#ifdef MACHO_SNAPSHOTS
+		myShares[i] = 0;
+#endif
+	}
+
+	myArena = static_cast<char *>(::operator new(arenaSize));
 }
 
 void _MachineBase::free(unsigned int count) {
 	// Free from end of list, so that child states are freed first
+	// Objects live in arena: only destruct them.
 	unsigned int i = count;
 	while (i > 0) {
 		--i;
-		delete myInstances[i];
-		myInstances[i] = 0;
-	}
-}
-
-// Clear history of state and children.
-void _MachineBase::clearHistoryDeep(unsigned int count, const _StateInstance & instance) {
-	for (unsigned int i = 0; i < count; ++i) {
-		_StateInstance * s = myInstances[i];
-		if (s && s->isChild(instance))
-			s->setHistory(0);
-	}
-}
-
-#ifdef MACHO_SNAPSHOTS
-void _MachineBase::copy(_StateInstance ** others, unsigned int count) {
-	// Create StateInstance objects
-	for (ID i = 0; i < count; ++i)
-		createClone(i, others[i]);
-
-	// Copy StateInstance object's state
-	for (ID i = 0; i < count; ++i) {
-		_StateInstance * state = myInstances[i];
-		if (state) {
-			assert(others[i]);
-			state->copy(*others[i]);
+		if (myInstances[i]) {
+			myInstances[i]->~_StateInstance();
+			myInstances[i] = 0;
 		}
 	}
 }
 
-_StateInstance * _MachineBase::createClone(ID id, _StateInstance * original) {
-	_StateInstance * & clone = getInstance(id);
+#ifdef MACHO_SNAPSHOTS
+unsigned long _MachineBase::checkpoint() {
+	for (ID i = 0; i < myChangeCount; ++i)
+		myChanged[myChanges[i] / BITS] = 0;
+	myChangeCount = 0;
 
-	// Object already created?
-	if (!clone && original)
-		clone = original->clone(*this);
+	myLatestGeneration = ++myGenerations;
+	myLatestMachine = this;
 
-	return clone;
+	return myLatestGeneration;
 }
 #endif
 
-// Performs a pending state transition.
-void _MachineBase::rattleOn() {
-	assert(myCurrentState);
+// Performs pending state transitions (including those started by init
+// actions).
+void _MachineBase::transit() {
+	// Loop here because init actions might change state again.
+	while (myPendingState) {
+		MACHO_TRC3(myCurrentState->name(), "Transition to", myPendingState->name());
 
-	while (myPendingState || myPendingEvent) {
+		// Entry/Exit actions may not dispatch events.
+		myInTransition = true;
 
-		// Loop here because init actions might change state again.
-		while (myPendingState) {
-			MACHO_TRC3(myCurrentState->name(), "Transition to", myPendingState->name());
+		// Levels of hierarchy unaffected by transition.
+		ID kept = myCurrentState->commonLevels(*myPendingState);
 
-#ifndef NDEBUG
-			// Entry/Exit actions may not dispatch events: set dummy event.
-			if (!myPendingEvent)
-				myPendingEvent = (_IEventBase *) &myPendingEvent;
-#endif
+		// Perform exit actions (which exactly depends on new state).
+		myCurrentState->exit(kept);
 
-			// Perform exit actions (which exactly depends on new state).
-			myCurrentState->exit(*myPendingState);
+		// Store history information for previous state now.
+		// Previous state will be used for deep history.
+		myCurrentState->setHistorySuper(*myCurrentState);
 
-			// Store history information for previous state now.
-			// Previous state will be used for deep history.
-			myCurrentState->setHistorySuper(*myCurrentState);
+		myCurrentState = myPendingState;
 
-			_StateInstance * previous = myCurrentState;
-			myCurrentState = myPendingState;
+		// Deprecated!
+		if (myPendingBox) {
+			myCurrentState->setBox(myPendingBox);
+			myPendingBox = 0;
+		}
 
-			// Deprecated!
-			if (myPendingBox) {
-				myCurrentState->setBox(myPendingBox);
-				myPendingBox = 0;
-			}
+		// Perform entry actions on next state's parents (which exactly depends on previous state).
+		myCurrentState->entry(kept);
 
-			// Perform entry actions on next state's parents (which exactly depends on previous state).
-			myCurrentState->entry(*previous);
+		// State transition complete.
+		// Clear 'pending' information just now so that setState would assert in exits and entries, but not in init.
+		myPendingState = 0;
 
-			// State transition complete.
-			// Clear 'pending' information just now so that setState would assert in exits and entries, but not in init.
-			myPendingState = 0;
+		// Use initializer to call proper "init" action.
+		_Initializer * init = myPendingInit;
+		myPendingInit = 0;
 
-			// Use initializer to call proper "init" action.
-			_Initializer * init = myPendingInit;
-			myPendingInit = 0;
+		init->execute(*myCurrentState);
+		destroyInitializer(init);
 
-			init->execute(*myCurrentState);
-			init->destroy();
+		assert("Init may only transition to proper substates" &&
+		       (!myPendingState ||
+		        (myPendingState->isChild(*myCurrentState) && (myCurrentState != myPendingState)))
+		);
 
-			assert("Init may only transition to proper substates" &&
-			       (!myPendingState ||
-			        (myPendingState->isChild(*myCurrentState) && (myCurrentState != myPendingState)))
-			);
+		myInTransition = false;
+	} // while (myPendingState)
+}
 
-#ifndef NDEBUG
-			// Clear dummy event if need be
-			if (myPendingEvent == (_IEventBase *) &myPendingEvent)
-				myPendingEvent = 0;
-#endif
-		} // while (myPendingState)
+// Performs a pending state transition.
+void _MachineBase::rattleOn() {
+	assert(myCurrentState);
 
-		if (myPendingEvent) {
-			_IEventBase * event = myPendingEvent;
-			myPendingEvent = 0;
-			event->dispatch(*myCurrentState);
-			delete event;
-		}
+	_RunningMachine running(*this);
+
+	for (;;) {
+		transit();
+
+		// Run to completion: next event only after transitions are done.
+		// Events dispatched by handlers come first.
+		_IEventBase * event = myDispatched.pop();
+		if (!event)
+			event = myEvents.pop();
+		if (!event)
+			break;
+
+		event->dispatch(*myCurrentState);
+		delete event;
+
+	} // for (;;)
 
-	} // while (myPendingState || myPendingEvent)
+	publish();
 
 } // rattleOn
 
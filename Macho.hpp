@@ -208,6 +208,55 @@
 
 #include <new>
 #include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#if __cplusplus >= 201103L
+#	include <type_traits>
+#endif
+
+#ifdef MACHO_THREADS
+#	include <atomic>
+#	include <condition_variable>
+#	include <deque>
+#	include <mutex>
+#	include <thread>
+#	include <unordered_map>
+#	include <vector>
+#endif
+
+// Capacity of a machine's event queue (must be a power of two).
+#ifndef MACHO_EVENT_QUEUE_SIZE
+#	define MACHO_EVENT_QUEUE_SIZE 16
+#endif
+
+// Default capacity in bytes of InlineEvent objects.
+#ifndef MACHO_INLINE_EVENT_SIZE
+#	define MACHO_INLINE_EVENT_SIZE 64
+#endif
+
+// Event objects up to this size (in bytes) are recycled by event pools.
+#ifndef MACHO_EVENT_POOL_LIMIT
+#	define MACHO_EVENT_POOL_LIMIT 128
+#endif
+
+// Maximum number of free blocks an event pool keeps per block size.
+#ifndef MACHO_EVENT_POOL_DEPTH
+#	define MACHO_EVENT_POOL_DEPTH 256
+#endif
+
+// Capacity in bytes of a machine's places for state initializers (holding
+// the parameters of parametrized transitions).
+#ifndef MACHO_INITIALIZER_SIZE
+#	define MACHO_INITIALIZER_SIZE 64
+#endif
+
+// Unsigned integer type of history entries (state IDs): limits the number of
+// states of a machine type to its range.
+#ifndef MACHO_HISTORY_ID
+#	define MACHO_HISTORY_ID unsigned short
+#endif
 
 class TestAccess;
 
@@ -315,6 +364,17 @@ namespace Macho {
 	template<class T>
 	class Machine;
 
+	template<class T>
+	class MachinePool;
+
+	template<class T, class B>
+	class PublishedBox;
+
+#ifdef MACHO_THREADS
+	template<class T>
+	class Scheduler;
+#endif
+
 	template<class T>
 	class IEvent;
 
@@ -324,6 +384,9 @@ namespace Macho {
 	// Use Alias to get to ID.
 	typedef unsigned int ID;
 
+	// ID as stored in history arrays.
+	typedef MACHO_HISTORY_ID _HistoryID;
+
 	// Key is used to build Alias object (points to _KeyData).
 	typedef void * Key;
 
@@ -341,6 +404,16 @@ namespace Macho {
 		typedef bool Check;
 	};
 
+	// Check condition at compile time.
+	template<bool C>
+	struct _Assert {
+	};
+
+	template<>
+	struct _Assert<true> {
+		typedef bool Check;
+	};
+
 	// Remove reference modifier from type.
 	template<class R>
 	struct DR {
@@ -358,6 +431,72 @@ namespace Macho {
 	};
 
 
+	////////////////////////////////////////////////////////////////////////////////
+	// Value shared between threads. With MACHO_THREADS defined this wraps
+	// std::atomic (needs C++11), otherwise it is a plain variable.
+	template<class T>
+	class _AtomicValue {
+	public:
+		_AtomicValue(T value = T()) : myValue(value) {}
+
+#ifdef MACHO_THREADS
+		T get() const { return myValue.load(std::memory_order_acquire); }
+		T getRelaxed() const { return myValue.load(std::memory_order_relaxed); }
+		void set(T value) { myValue.store(value, std::memory_order_release); }
+
+		// On failure 'expected' receives the current value.
+		bool compareAndSet(T & expected, T value) {
+			return myValue.compare_exchange_weak(expected, value, std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<T> myValue;
+#else
+		T get() const { return myValue; }
+		T getRelaxed() const { return myValue; }
+		void set(T value) { myValue = value; }
+
+		// On failure 'expected' receives the current value.
+		bool compareAndSet(T & expected, T value) {
+			if (myValue != expected) {
+				expected = myValue;
+				return false;
+			}
+			myValue = value;
+			return true;
+		}
+
+	private:
+		T myValue;
+#endif
+
+		_AtomicValue(const _AtomicValue & other);
+		_AtomicValue & operator=(const _AtomicValue & other);
+	};
+
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Raw memory for objects constructed in place, suitably aligned for any type.
+	template<unsigned int SIZE>
+	class _Storage {
+		union Unit {
+			long double myLongDouble;
+			double myDouble;
+			long myLong;
+			void * myPointer;
+			void (*myFunction)();
+		};
+
+	public:
+		enum { CAPACITY = ((SIZE + sizeof(Unit) - 1) / sizeof(Unit)) * sizeof(Unit) };
+
+		void * place() { return myUnits; }
+
+	private:
+		Unit myUnits[CAPACITY / sizeof(Unit)];
+	};
+
+
 	////////////////////////////////////////////////////////////////////////////////
 	// Superstate for template states: allows multiple numbered instances of the same
 	// template state for a single anchor state.
@@ -407,11 +546,41 @@ namespace Macho {
 	}
 
 #ifdef MACHO_SNAPSHOTS
+	// Copy of box, in 'place' if given.
 	template<class B>
-	void * _cloneBox(void * other) {
+	void * _cloneBox(const void * other, void * & place) {
 		assert(other);
-		return new B(*static_cast<B *>(other));
+		if (!place)
+			place = ::operator new(sizeof(B));
+
+		new (place) B(*static_cast<const B *>(other));
+
+		void * box = place;
+		place = 0;
+
+		return box;
 	}
+
+	template<class B>
+	void _destroyBox(void * box) {
+		static_cast<B *>(box)->~B();
+		::operator delete(box);
+	}
+
+	// Box shared by a machine and its snapshots until the machine modifies
+	// it (copy on write). Deleted with the last reference.
+	struct _SharedBox {
+		void * box;
+		unsigned long references;
+		void (*destroy)(void * box);
+
+		void release() {
+			if (--references == 0) {
+				destroy(box);
+				delete this;
+			}
+		}
+	};
 #endif
 
 	// Specializations for EmptyBox:
@@ -424,7 +593,7 @@ namespace Macho {
 
 #ifdef MACHO_SNAPSHOTS
 	template<>
-	void * _cloneBox<_EmptyBox>(void * other);
+	void * _cloneBox<_EmptyBox>(const void * other, void * & place);
 #endif
 
 
@@ -432,17 +601,120 @@ namespace Macho {
 	// Essential information pointed at by state key.
 	struct _KeyData {
 		typedef _StateInstance & (*Generator)(_MachineBase & machine);
-		typedef bool (*Predicate)(Key);
 		typedef const char * (*NameFn)();
 
 		// Get StateInstance object from key.
 		const Generator instanceGenerator;
 
-		// Is state of given key a child state?
-		const Predicate childPredicate;
-
 		const NameFn name;
 		const ID id;
+
+		// Number of superstates (top state has depth 0).
+		const ID depth;
+
+		// Keys of this state and its superstates, indexed by depth.
+		const _KeyData * const * const path;
+
+		// Is state of given key a child state (or this state)?
+		// Constant time: 'other' is a superstate if it is on our path.
+		bool isChild(const _KeyData * other) const {
+			return other->depth <= depth && path[other->depth] == other;
+		}
+
+		// Fill 'path' with path of superstate and 'self'.
+		static const _KeyData * const * buildPath(const _KeyData ** path, const _KeyData * const * superPath, ID depth, const _KeyData * self) {
+			for (ID i = 0; i < depth; ++i)
+				path[i] = superPath[i];
+			path[depth] = self;
+
+			return path;
+		}
+	};
+
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Table of all states of a state machine type, filled by StateID while
+	// program starts: allows finding state keys by ID or name.
+	// Also lays out the arena of machines: every state gets a slot for its
+	// StateInstance and state object, Root the first one.
+	class _KeyTable {
+	public:
+		typedef Key (*KeyFn)();
+		typedef const char * (*NameFn)();
+
+		_KeyTable();
+		~_KeyTable();
+
+		// Register state with given ID, needing 'size' bytes of arena.
+		// Key functions may not be called yet (other IDs may not be assigned).
+		void insert(ID id, KeyFn key, NameFn name, std::size_t size);
+
+		// Round size up so that objects placed behind are properly aligned.
+		static std::size_t align(std::size_t size) {
+			const std::size_t unit = _Storage<1>::CAPACITY;
+			return (size + unit - 1) / unit * unit;
+		}
+
+		// Offset of state's slot in arena.
+		std::size_t offset(ID id) const {
+			assert(id < mySize);
+			return myOffsets[id];
+		}
+
+		// Size in bytes of arena holding all states.
+		std::size_t arenaSize() const {
+			return myArenaSize;
+		}
+
+		// Key of state with given ID (0 if there is no such state). Constant time.
+		Key find(ID id) const {
+			return id < mySize && myKeys[id] ? myKeys[id]() : 0;
+		}
+
+		// Key of state with given name (0 if there is no such state).
+		// Logarithmic time. Instances of template states share a name, the
+		// one registered first is found.
+		Key find(const char * name) const;
+
+		// Number states in pre-order (superstates before substates, subtrees
+		// contiguous). Call once all states are registered.
+		const _KeyTable & order();
+
+		// IDs of state 'id' and its substates: [first, last).
+		void subtree(ID id, const ID * & first, const ID * & last) const {
+			assert(id <= myCount && myPreorder);
+			first = myPreorder + myPositions[id];
+			last = first + mySubtrees[id];
+		}
+
+	protected:
+		struct Name {
+			NameFn name;
+			ID id;
+		};
+
+		// Key functions indexed by ID.
+		KeyFn * myKeys;
+
+		// Names sorted alphabetically.
+		Name * myNames;
+
+		// Arena slots indexed by ID.
+		std::size_t * myOffsets;
+		std::size_t myArenaSize;
+
+		// IDs in pre-order (Root first), and position in it and size of
+		// subtree indexed by ID.
+		ID * myPreorder;
+		ID * myPositions;
+		ID * mySubtrees;
+
+		ID mySize;
+		ID myCount;
+
+	private:
+		_KeyTable(const _KeyTable &);
+		_KeyTable & operator=(const _KeyTable &);
 	};
 
 
@@ -458,10 +730,17 @@ namespace Macho {
 			return false;
 		}
 
+		// Root is above top state (depth 0).
+		enum { _DEPTH = -1 };
+
 	protected:
+#ifdef MACHO_FLYWEIGHT
+		_StateSpecification(_StateInstance & instance) {}
+#else
 		_StateSpecification(_StateInstance & instance)
 			: _myStateInstance(instance)
 		{}
+#endif
 
 		// Initiate transition to a new state.
 		// Template parameter S is the new state to enter.
@@ -557,13 +836,21 @@ namespace Macho {
 		// Create StateInstance object of state.
 		static _StateInstance & _getInstance(_MachineBase & machine);
 
+		// Root has no key.
+		static const _KeyData * const * _keyPath() { return 0; }
+
 		virtual void _deleteBox(_StateInstance & instance) {}
 
 		// Default history strategy (no history).
 		virtual void _saveHistory(_StateInstance & self, _StateInstance & shallow, _StateInstance & deep) {}
 
+		// Machine the state is running on.
+		_MachineBase & _machine();
+
 	private:
+#ifndef MACHO_FLYWEIGHT
 		_StateInstance & _myStateInstance;
+#endif
 	};
 
 
@@ -609,17 +896,24 @@ namespace Macho {
 		// Alias represents state.
 		static Alias alias();
 
+		// Depth of state in hierarchy (top state has depth 0).
+		enum { _DEPTH = P::_DEPTH + 1 };
+
 		static bool isChild(Key other) {
-			return key() == other || SUPER::isChild(other);
+			return static_cast<_KeyData *>(key())->isChild(static_cast<_KeyData *>(other));
 		}
 
 		static bool isParent(Key other) {
-			return static_cast<_KeyData *>(other)->childPredicate(key());
+			return static_cast<_KeyData *>(other)->isChild(static_cast<_KeyData *>(key()));
 		}
 
 		// Is machine m in this state?
 		static bool isCurrent(const _MachineBase & m);
 
+		// Is published state of machine m this state (or a substate)? May be
+		// called from any thread, unlike 'isCurrent' (see publishedState).
+		static bool isPublished(const _MachineBase & m);
+
 		// Deprecated!
 		// Is machine m in exactly this state?
 		static bool isCurrentDirect(const _MachineBase & m);
@@ -628,6 +922,7 @@ namespace Macho {
 
 		static void clearHistoryDeep(_MachineBase & m);
 
+		// History is only for the thread running the machine.
 		static Alias history(const _MachineBase & m);
 
 	protected:
@@ -656,6 +951,7 @@ namespace Macho {
 
 		// for _getInstance
 		friend class Machine<TOP>;
+		friend class MachinePool<TOP>;
 
 		// for _getInstance
 		friend class Alias;
@@ -666,6 +962,11 @@ namespace Macho {
 		// Create StateInstance object of state.
 		static _StateInstance & _getInstance(_MachineBase & machine);
 
+		// Path of keys from top state down to this state.
+		static const _KeyData * const * _keyPath() {
+			return static_cast<_KeyData *>(key())->path;
+		}
+
 		// Box is by default not persistent. Not redundant!
 		virtual void _deleteBox(_StateInstance & instance);
 
@@ -675,8 +976,10 @@ namespace Macho {
 			this->_setHistorySuper(self, deep);
 		}
 
+#ifndef MACHO_FLYWEIGHT
 	private:
 		_StateInstance & _myStateInstance;
+#endif
 	};
 
 
@@ -696,17 +999,25 @@ namespace Macho {
 	// instance.
 	class _StateInstance {
 	protected:
-		_StateInstance(_MachineBase & machine, _StateInstance * parent);
+		// 'key' is 0 for Root.
+		_StateInstance(_MachineBase & machine, _StateInstance * parent, const _KeyData * key);
 
 	public:
 		virtual ~_StateInstance();
 
-		// Perform entry actions.
-		// 'first' is true on very first call.
-		void entry(_StateInstance & previous, bool first = true);
+		// Number of hierarchy levels that stay entered on transition to
+		// 'next': levels down to the least common ancestor of both states, or
+		// above 'next' if it is a superstate (or this state), because then
+		// 'next' itself is left and reentered.
+		ID commonLevels(const _StateInstance & next) const;
 
-		// Perform exit actions.
-		void exit(_StateInstance & next);
+		// Perform entry actions of this state and its superstates below the
+		// first 'kept' levels (see commonLevels), outermost state first.
+		void entry(ID kept);
+
+		// Perform exit actions of this state and its superstates below the
+		// first 'kept' levels (see commonLevels), innermost state first.
+		void exit(ID kept);
 
 		// Perform init action.
 		void init(bool history);
@@ -723,14 +1034,6 @@ namespace Macho {
 				myParent->saveHistory(*this, deep);
 		}
 
-#ifdef MACHO_SNAPSHOTS
-		// Copy state of another StateInstance object.
-		void copy(_StateInstance & original);
-
-		// Create a clone of StateInstance object for another machine.
-		_StateInstance * clone(_MachineBase & newMachine);
-#endif
-
 		void shutdown() {
 			mySpecification->_shutdown();
 		}
@@ -745,31 +1048,47 @@ namespace Macho {
 
 		virtual const char * name() = 0;
 
-		// 'Virtual constructor' needed for cloning.
-		virtual _StateInstance * create(_MachineBase & machine, _StateInstance * parent) = 0;
-
 		virtual void createBox() = 0;
 		virtual void deleteBox() = 0;
+
 #ifdef MACHO_SNAPSHOTS
-		virtual void cloneBox(void * box) = 0;
+		// Share box with a snapshot (there must be one, other than EmptyBox).
+		virtual _SharedBox * shareBox() = 0;
+
+		// Replace box shared with snapshots by own copy.
+		virtual void unshareBox() = 0;
+
+		// Box for modification: copied first if shared with snapshots.
+		void * ownBox() {
+			if (shareSlot())
+				unshareBox();
+			assert(!boxPlace());
+			return box();
+		}
+
+		// Set box (shared if 'share' is given) as in a snapshot being
+		// restored. Keeps a box still shared with it, and the memory of an
+		// own box for its next copy.
+		void restoreBox(void * box, _SharedBox * share);
 #endif
 
 		// Only needed for top state (constructor of Machine calls this)
-		void setBox(void * box) {
-			assert(!myBox);
+		void setBox(void * box);
 
-			if (myBoxPlace) {
-				// Free cached memory of previously used box.
-				::operator delete(myBoxPlace);
-				myBoxPlace = 0;
-			}
+		// Is 'instance' a superstate (or this state)?
+		bool isChild(const _StateInstance & instance) const {
+			// Root (which has no key) is superstate of all states.
+			return !instance.myKeyData || (myKeyData && myKeyData->isChild(instance.myKeyData));
+		}
 
-			myBox = box;
+		// Is state of 'key' a superstate (or this state)?
+		bool isChild(Key key) const {
+			return myKeyData && myKeyData->isChild(static_cast<const _KeyData *>(key));
 		}
 
-		// Is 'instance' a superstate?
-		bool isChild(const _StateInstance & instance) {
-			return this == &instance || (myParent && myParent->isChild(instance));
+		// Number of levels in hierarchy down to this state (0 for Root).
+		ID levels() const {
+			return myKeyData ? myKeyData->depth + 1 : 0;
 		}
 
 		_StateSpecification & specification() {
@@ -777,31 +1096,54 @@ namespace Macho {
 			return *mySpecification;
 		}
 
-		void * box() {
-			assert(myBox);
-			return myBox;
+		void * box() const {
+			assert(boxSlot());
+			return boxSlot();
 		}
 
 		_MachineBase & machine() {
 			return myMachine;
 		}
 
-		// const: History can be manipulated even on a const object.
-		void setHistory(_StateInstance * history) const {
-			myHistory = history;
+		// Place of state object in arena: behind StateInstance object of
+		// given size.
+		void * specificationPlace(std::size_t size) {
+			return reinterpret_cast<char *>(this) + _KeyTable::align(size);
 		}
 
-		_StateInstance * history() const {
-			return myHistory;
-		}
+		// const: History can be manipulated even on a const object.
+		void setHistory(_StateInstance * history) const;
+
+		_StateInstance * history() const;
+
+	protected:
+		// Box, and reused box heap memory, are kept by machine. There is
+		// never both an own box and memory for reuse: memory is kept only
+		// while there is no box or (with snapshots) the box is shared.
+		// Creating, copying or taking back the box uses or frees it.
+		void * & boxSlot() const;
+		void * & boxPlace() const;
+
+#ifdef MACHO_SNAPSHOTS
+		// Box shared with snapshots (0 if not), kept by machine.
+		_SharedBox * & shareSlot() const;
+
+		// Box has changed since latest snapshot.
+		void changed() const;
+
+		// Release box if shared; returns false if it is not.
+		bool dropBox();
+#endif
+
+		// for myID (see publish)
+		friend class _MachineBase;
 
 	protected:
 		_MachineBase & myMachine;
+		const _KeyData * const myKeyData;
+		const ID myID;
 		_StateSpecification * mySpecification;   // Instance of state class
-		mutable _StateInstance * myHistory;
 		_StateInstance * myParent;
-		void * myBox;
-		void * myBoxPlace;	// Reused box heap memory
 	};
 
 
@@ -812,9 +1154,14 @@ namespace Macho {
 		friend class _StateSpecification;
 
 		_RootInstance(_MachineBase & machine, _StateInstance * parent)
-			: _StateInstance(machine, parent)
+			: _StateInstance(machine, parent, 0)
 		{
-			mySpecification = new _StateSpecification(*this);
+#ifdef MACHO_FLYWEIGHT
+			static _StateSpecification theSpecification(*this);
+			mySpecification = &theSpecification;
+#else
+			mySpecification = new (specificationPlace(sizeof(*this))) _StateSpecification(*this);
+#endif
 		}
 
 	public:
@@ -830,14 +1177,19 @@ namespace Macho {
 		virtual void createBox() {}
 		virtual void deleteBox() {}
 #ifdef MACHO_SNAPSHOTS
-		virtual void cloneBox(void * box) {}
+		virtual _SharedBox * shareBox() { assert(false); return 0; }
+		virtual void unshareBox() {}
 #endif
 
 		virtual const char * name() { return "Root"; }
 
-		// 'Virtual constructor' needed for cloning.
-		virtual _StateInstance * create(_MachineBase & machine, _StateInstance * parent) {
-			return new _RootInstance(machine, parent);
+		// Bytes of arena needed for Root.
+		static std::size_t arenaSize() {
+#ifdef MACHO_FLYWEIGHT
+			return _KeyTable::align(sizeof(_RootInstance));
+#else
+			return _KeyTable::align(sizeof(_RootInstance)) + _KeyTable::align(sizeof(_StateSpecification));
+#endif
 		}
 
 	};
@@ -853,18 +1205,24 @@ namespace Macho {
 		friend class Link;
 
 		_SubstateInstance(_MachineBase & machine, _StateInstance * parent)
-			: _StateInstance(machine, parent)
+			: _StateInstance(machine, parent, static_cast<_KeyData *>(S::key()))
 		{
 			assert(parent);
-			this->mySpecification = new S(*this);
+#ifdef MACHO_FLYWEIGHT
+			// State objects are shared by all machines.
+			static S theSpecification(*this);
+			this->mySpecification = &theSpecification;
+#else
+			this->mySpecification = new (this->specificationPlace(sizeof(*this))) S(*this);
+#endif
 		}
 
 	public:
 		typedef typename S::Box Box;
 
 		virtual ~_SubstateInstance() {
-			if (this->myBox)
-				Macho::_deleteBox<Box>(myBox, myBoxPlace);
+			if (this->boxSlot())
+				deleteBox();
 		}
 
 		virtual const char * name() { return S::_state_name(); }
@@ -877,27 +1235,76 @@ namespace Macho {
 			return S::key();
 		}
 
-		// 'Virtual constructor' needed for cloning.
-		virtual _StateInstance * create(_MachineBase & machine, _StateInstance * parent) {
-			return new _SubstateInstance<S>(machine, parent);
+		// Place of StateInstance object in machine's arena.
+		static void * place(_MachineBase & machine);
+
+		// Bytes of arena needed for state.
+		static std::size_t arenaSize() {
+#ifdef MACHO_FLYWEIGHT
+			return _KeyTable::align(sizeof(_SubstateInstance<S>));
+#else
+			return _KeyTable::align(sizeof(_SubstateInstance<S>)) + _KeyTable::align(sizeof(S));
+#endif
 		}
 
 		virtual void createBox() {
-			if (!this->myBox)
-				this->myBox = Macho::_createBox<Box>(myBoxPlace);
+			void * & box = this->boxSlot();
+			if (!box) {
+				box = Macho::_createBox<Box>(this->boxPlace());
+#ifdef MACHO_SNAPSHOTS
+				this->changed();
+#endif
+			}
 		}
 
 		virtual void deleteBox() {
-			assert(myBox);
-			Macho::_deleteBox<Box>(myBox, myBoxPlace);
+			assert(this->boxSlot());
+#ifdef MACHO_SNAPSHOTS
+			this->changed();
+			if (this->dropBox())
+				return;
+#endif
+			Macho::_deleteBox<Box>(this->boxSlot(), this->boxPlace());
 		}
 
 #ifdef MACHO_SNAPSHOTS
-		virtual void cloneBox(void * box) {
-			assert(!myBox);
-			assert(!myBoxPlace);
-			// Needs copy constructor in ALL box types.
-			myBox = Macho::_cloneBox<Box>(box);
+		virtual _SharedBox * shareBox() {
+			assert(this->boxSlot() && this->boxSlot() != &_EmptyBox::theEmptyBox);
+
+			_SharedBox * & share = this->shareSlot();
+			if (!share) {
+				share = new _SharedBox;
+				share->box = this->boxSlot();
+				share->references = 1;
+				share->destroy = &Macho::_destroyBox<Box>;
+			}
+
+			++share->references;
+			return share;
+		}
+
+		virtual void unshareBox() {
+			_SharedBox * & share = this->shareSlot();
+			assert(share);
+
+			if (share->references == 1) {
+				// No snapshot holds box anymore: take it back. Memory kept
+				// for a copy is not needed then.
+				void * & place = this->boxPlace();
+				if (place) {
+					::operator delete(place);
+					place = 0;
+				}
+				this->boxSlot() = share->box;
+				delete share;
+			} else {
+				// Needs copy constructor in ALL box types.
+				this->boxSlot() = Macho::_cloneBox<Box>(share->box, this->boxPlace());
+				share->release();
+			}
+			share = 0;
+
+			this->changed();
 		}
 #endif
 
@@ -915,11 +1322,268 @@ namespace Macho {
 	};
 
 
+	// Bounded FIFO of event objects. Any number of threads may push, but only
+	// the thread running the machine may pop. Lock-free with MACHO_THREADS
+	// (each cell carries a sequence number telling whether it is free or full).
+	class _EventQueue {
+	public:
+		// 'size' must be a power of two.
+		explicit _EventQueue(unsigned long size);
+
+		// Deletes events still queued.
+		~_EventQueue();
+
+		// Returns false if queue is full (event is not taken over then).
+		bool push(_IEventBase * event) {
+			assert(event);
+
+			unsigned long position = myPushPosition.getRelaxed();
+			Cell * cell;
+
+			for (;;) {
+				cell = &myCells[position & myMask];
+				long difference = long(cell->sequence.get() - position);
+
+				if (difference == 0) {
+					// Cell is free: try to claim it.
+					if (myPushPosition.compareAndSet(position, position + 1))
+						break;
+				} else if (difference < 0)
+					return false;
+				else
+					// Other producer was faster.
+					position = myPushPosition.getRelaxed();
+			}
+
+			cell->event = event;
+			cell->sequence.set(position + 1);
+			return true;
+		}
+
+		// Returns 0 if queue is empty.
+		_IEventBase * pop() {
+			Cell & cell = myCells[myPopPosition & myMask];
+			if (cell.sequence.get() != myPopPosition + 1)
+				return 0;
+
+			_IEventBase * event = cell.event;
+			// Free cell for the push one round later.
+			cell.sequence.set(myPopPosition + myMask + 1);
+			++myPopPosition;
+
+			return event;
+		}
+
+		// Only reliable for the popping thread.
+		bool empty() const {
+			return empty(myPopPosition);
+		}
+
+		// Is there no event at pop position 'position'? May be asked by a
+		// thread which has stopped popping (position is taken before).
+		bool empty(unsigned long position) const {
+			return myCells[position & myMask].sequence.get() != position + 1;
+		}
+
+		// Only to be read by the popping thread.
+		unsigned long popPosition() const {
+			return myPopPosition;
+		}
+
+	private:
+		struct Cell {
+			_AtomicValue<unsigned long> sequence;
+			_IEventBase * event;
+		};
+
+		Cell * myCells;
+		const unsigned long myMask;
+
+		_AtomicValue<unsigned long> myPushPosition;
+		unsigned long myPopPosition;
+
+		_EventQueue(const _EventQueue & other);
+		_EventQueue & operator=(const _EventQueue & other);
+	};
+
+
+	// Unbounded FIFO of event objects dispatched by handlers, used only by
+	// the thread running the machine: a full _EventQueue must not make a
+	// handler lose its events.
+	class _EventFifo {
+	public:
+		_EventFifo()
+			: myEvents(0)
+			, myCapacity(0)
+			, myFirst(0)
+			, myCount(0)
+		{}
+
+		// Deletes events still queued.
+		~_EventFifo();
+
+		void push(_IEventBase * event) {
+			assert(event);
+			if (myCount == myCapacity)
+				grow();
+
+			myEvents[(myFirst + myCount) & (myCapacity - 1)] = event;
+			++myCount;
+		}
+
+		// Returns 0 if empty.
+		_IEventBase * pop() {
+			if (!myCount)
+				return 0;
+
+			_IEventBase * event = myEvents[myFirst];
+			myFirst = (myFirst + 1) & (myCapacity - 1);
+			--myCount;
+
+			return event;
+		}
+
+		bool empty() const {
+			return !myCount;
+		}
+
+	private:
+		// Double capacity (a power of two).
+		void grow();
+
+		_IEventBase ** myEvents;
+		unsigned long myCapacity;
+		unsigned long myFirst;
+		unsigned long myCount;
+
+		_EventFifo(const _EventFifo & other);
+		_EventFifo & operator=(const _EventFifo & other);
+	};
+
+
+	// Usage statistics of an event pool (see Machine::eventPoolStatistics).
+	struct PoolStatistics {
+		unsigned long allocations;	// Event objects created
+		unsigned long reused;		// ... with memory taken from pool
+		unsigned long oversized;	// ... too large to be pooled
+		unsigned long cached;		// Free blocks kept by pool
+		unsigned long cachedBytes;	// Memory of free blocks
+	};
+
+
+	// Free list allocator for event objects, one list per block size
+	// (multiples of GRANULARITY). Freed blocks are kept for reuse instead of
+	// being returned to the heap. Has no constructor, so pools with static
+	// storage are usable during static initialization and destruction.
+	struct _EventPool {
+		enum {
+			GRANULARITY = 16,
+			CLASSES = (MACHO_EVENT_POOL_LIMIT + GRANULARITY - 1) / GRANULARITY
+		};
+
+		void * allocate(std::size_t size) {
+			++myAllocations;
+
+			std::size_t index = (size - 1) / GRANULARITY;
+			if (index >= CLASSES) {
+				++myOversized;
+				return ::operator new(size);
+			}
+
+			Block * block = myBlocks[index];
+			if (!block)
+				return ::operator new((index + 1) * GRANULARITY);
+
+			myBlocks[index] = block->next;
+			--myCached[index];
+			++myReused;
+			return block;
+		}
+
+		void deallocate(void * memory, std::size_t size) {
+			std::size_t index = (size - 1) / GRANULARITY;
+			if (index >= CLASSES || myReleased || myCached[index] >= MACHO_EVENT_POOL_DEPTH) {
+				::operator delete(memory);
+				return;
+			}
+
+			Block * block = static_cast<Block *>(memory);
+			block->next = myBlocks[index];
+			myBlocks[index] = block;
+			++myCached[index];
+		}
+
+		PoolStatistics statistics() const;
+
+		// Return free blocks to heap, and any blocks freed from now on.
+		void release();
+
+		struct Block {
+			Block * next;
+		};
+
+		Block * myBlocks[CLASSES];
+		unsigned long myCached[CLASSES];
+		unsigned long myAllocations;
+		unsigned long myReused;
+		unsigned long myOversized;
+		bool myReleased;
+	};
+
+
+	// Releases pool when program (or thread) ends.
+	class _EventPoolReleaser {
+	public:
+		_EventPoolReleaser(_EventPool & pool) : myPool(pool) {}
+		~_EventPoolReleaser() { myPool.release(); }
+
+	private:
+		_EventPool & myPool;
+	};
+
+
+	template<class TOP, unsigned int SIZE>
+	class InlineEvent;
+
 	// Interface for event objects (bound to a top state)
 	template<class TOP>
 	class IEvent : protected _IEventBase {
+	public:
+		// Event objects of a top state share a pool of memory blocks
+		// (one per thread with MACHO_THREADS).
+		static void * operator new(std::size_t size) {
+			return pool().allocate(size);
+		}
+
+		static void operator delete(void * memory, std::size_t size) {
+			pool().deallocate(memory, size);
+		}
+
+		// InlineEvent constructs events in place.
+		static void * operator new(std::size_t, void * place) {
+			return place;
+		}
+
+		static void operator delete(void *, void *) {}
+
+	private:
 		friend class Machine<TOP>;
+		friend class MachinePool<TOP>;
 		friend class TopBase<TOP>;
+
+		template<class T, unsigned int SIZE>
+		friend class InlineEvent;
+
+		static _EventPool & pool() {
+#ifdef MACHO_THREADS
+			static thread_local _EventPool thePool;
+			static thread_local _EventPoolReleaser theReleaser(thePool);
+#else
+			static _EventPool thePool;
+			static _EventPoolReleaser theReleaser(thePool);
+#endif
+			return thePool;
+		}
 	};
 
 
@@ -1143,13 +1807,107 @@ namespace Macho {
 		return new _Event0<TOP, R>(handler);
 	}
 
-} // namespace Macho
 
+	// Event object with value semantics: handler and parameters are stored
+	// inline, so creating, copying, queueing and dispatching it never touches
+	// the heap. Parameters must fit into SIZE bytes (checked at compile time).
+	// Create like this:
+	// InlineEvent<Top> event(&Top::event1, 42);
+	// machine.dispatch(event);
+	template<class TOP, unsigned int SIZE = MACHO_INLINE_EVENT_SIZE>
+	class InlineEvent {
+	public:
+		template<class R>
+		InlineEvent(R (TOP::*handler)()) {
+			init(_Event0<TOP, R>(handler));
+		}
 
-////////////////////////////////////////////////////////////////////////////////
-// MSVC++ 8.0 does not handle qualified member template friends:
-// http://connect.microsoft.com/VisualStudio/feedback/ViewFeedback.aspx?FeedbackID=101615
-// Otherwise call could happen directly in Initializer classes.
+		template<class R, class P1>
+		InlineEvent(R (TOP::*handler)(P1), const typename DR<P1>::T & p1) {
+			init(_Event1<TOP, R, P1>(handler, p1));
+		}
+
+		template<class R, class P1, class P2>
+		InlineEvent(R (TOP::*handler)(P1, P2), const typename DR<P1>::T & p1, const typename DR<P2>::T & p2) {
+			init(_Event2<TOP, R, P1, P2>(handler, p1, p2));
+		}
+
+		template<class R, class P1, class P2, class P3>
+		InlineEvent(R (TOP::*handler)(P1, P2, P3), const typename DR<P1>::T & p1, const typename DR<P2>::T & p2, const typename DR<P3>::T & p3) {
+			init(_Event3<TOP, R, P1, P2, P3>(handler, p1, p2, p3));
+		}
+
+		template<class R, class P1, class P2, class P3, class P4>
+		InlineEvent(R (TOP::*handler)(P1, P2, P3, P4), const typename DR<P1>::T & p1, const typename DR<P2>::T & p2, const typename DR<P3>::T & p3, const typename DR<P4>::T & p4) {
+			init(_Event4<TOP, R, P1, P2, P3, P4>(handler, p1, p2, p3, p4));
+		}
+
+		template<class R, class P1, class P2, class P3, class P4, class P5>
+		InlineEvent(R (TOP::*handler)(P1, P2, P3, P4, P5), const typename DR<P1>::T & p1, const typename DR<P2>::T & p2, const typename DR<P3>::T & p3, const typename DR<P4>::T & p4, const typename DR<P5>::T & p5) {
+			init(_Event5<TOP, R, P1, P2, P3, P4, P5>(handler, p1, p2, p3, p4, p5));
+		}
+
+		template<class R, class P1, class P2, class P3, class P4, class P5, class P6>
+		InlineEvent(R (TOP::*handler)(P1, P2, P3, P4, P5, P6), const typename DR<P1>::T & p1, const typename DR<P2>::T & p2, const typename DR<P3>::T & p3, const typename DR<P4>::T & p4, const typename DR<P5>::T & p5, const typename DR<P6>::T & p6) {
+			init(_Event6<TOP, R, P1, P2, P3, P4, P5, P6>(handler, p1, p2, p3, p4, p5, p6));
+		}
+
+		InlineEvent(const InlineEvent & other)
+			: myCopy(other.myCopy)
+		{
+			myEvent = myCopy(myStorage.place(), *other.myEvent);
+		}
+
+		InlineEvent & operator=(const InlineEvent & other) {
+			if (this == &other) return *this;
+
+			myEvent->~_IEventBase();
+			myCopy = other.myCopy;
+			myEvent = myCopy(myStorage.place(), *other.myEvent);
+
+			return *this;
+		}
+
+		~InlineEvent() {
+			myEvent->~_IEventBase();
+		}
+
+	private:
+		friend class Machine<TOP>;
+		friend class MachinePool<TOP>;
+
+		typedef _IEventBase * (*Copy)(void * place, const _IEventBase & other);
+
+		template<class E>
+		static _IEventBase * copy(void * place, const _IEventBase & other) {
+			return new (place) E(static_cast<const E &>(other));
+		}
+
+		template<class E>
+		void init(const E & event) {
+			// Compile time check: parameters must fit into inline storage
+			typedef typename _Assert<sizeof(E) <= _Storage<SIZE>::CAPACITY>::Check EventMustFitIntoInlineEvent;
+
+			myCopy = &copy<E>;
+			myEvent = myCopy(myStorage.place(), event);
+		}
+
+		void dispatch(_StateInstance & instance) const {
+			myEvent->dispatch(instance);
+		}
+
+		_IEventBase * myEvent;		// Points into myStorage
+		Copy myCopy;
+		_Storage<SIZE> myStorage;
+	};
+
+} // namespace Macho
+
+
+////////////////////////////////////////////////////////////////////////////////
+// MSVC++ 8.0 does not handle qualified member template friends:
+// http://connect.microsoft.com/VisualStudio/feedback/ViewFeedback.aspx?FeedbackID=101615
+// Otherwise call could happen directly in Initializer classes.
 class _VS8_Bug_101615 {
 public:
 	template<class S, class P1>
@@ -1202,8 +1960,11 @@ namespace Macho {
 	public:
 		virtual ~_Initializer() {}
 
-		// Create copy of initializer.
-		virtual _Initializer * clone() = 0;
+		// Create copy of initializer: in given place if it has room for it
+		// ('size' bytes), otherwise on heap.
+		// Copies made in place are destroyed by their owner calling the
+		// destructor, heap copies by calling 'destroy'.
+		virtual _Initializer * copy(void * place, std::size_t size) const = 0;
 
 		// Deallocate object.
 		virtual void destroy() { delete this; }
@@ -1215,10 +1976,22 @@ namespace Macho {
 	};
 
 
+	// Copy initializer object to place if it fits, otherwise onto heap.
+	template<class I>
+	_Initializer * _copyInitializer(const I & initializer, void * place, std::size_t size) {
+		if (sizeof(I) <= size)
+			return new (place) I(initializer);
+		else
+			return new I(initializer);
+	}
+
+
 	// Base class for Singleton initializers.
 	class _StaticInitializer : public _Initializer {
 		// Copy of Singleton is Singleton.
-		virtual _Initializer * clone() { return this; }
+		virtual _Initializer * copy(void * place, std::size_t size) const {
+			return const_cast<_StaticInitializer *>(this);
+		}
 
 		// Singletons are never destroyed.
 		virtual void destroy() {}
@@ -1254,8 +2027,8 @@ namespace Macho {
 			instance.init(true);
 		}
 
-		virtual _Initializer * clone() {
-			return new _AdaptingInitializer(myMachine);
+		virtual _Initializer * copy(void * place, std::size_t size) const {
+			return _copyInitializer(*this, place, size);
 		}
 
 		virtual Key adapt(Key key);
@@ -1273,8 +2046,8 @@ namespace Macho {
 			: myParam1(p1)
 		{}
 
-		virtual _Initializer * clone() {
-			return new _Initializer1<S, P1>(myParam1);
+		virtual _Initializer * copy(void * place, std::size_t size) const {
+			return _copyInitializer(*this, place, size);
 		}
 
 		virtual void execute(_StateInstance & instance) {
@@ -1293,8 +2066,8 @@ namespace Macho {
 			, myParam2(p2)
 		{}
 
-		virtual _Initializer * clone() {
-			return new _Initializer2<S, P1, P2>(myParam1, myParam2);
+		virtual _Initializer * copy(void * place, std::size_t size) const {
+			return _copyInitializer(*this, place, size);
 		}
 
 		void execute(_StateInstance & instance) {
@@ -1315,8 +2088,8 @@ namespace Macho {
 			, myParam3(p3)
 		{}
 
-		virtual _Initializer * clone() {
-			return new _Initializer3<S, P1, P2, P3>(myParam1, myParam2, myParam3);
+		virtual _Initializer * copy(void * place, std::size_t size) const {
+			return _copyInitializer(*this, place, size);
 		}
 
 		void execute(_StateInstance & instance) {
@@ -1339,8 +2112,8 @@ namespace Macho {
 			, myParam4(p4)
 		{}
 
-		virtual _Initializer * clone() {
-			return new _Initializer4<S, P1, P2, P3, P4>(myParam1, myParam2, myParam3, myParam4);
+		virtual _Initializer * copy(void * place, std::size_t size) const {
+			return _copyInitializer(*this, place, size);
 		}
 
 		void execute(_StateInstance & instance) {
@@ -1365,8 +2138,8 @@ namespace Macho {
 			, myParam5(p5)
 		{}
 
-		virtual _Initializer * clone() {
-			return new _Initializer5<S, P1, P2, P3, P4, P5>(myParam1, myParam2, myParam3, myParam4, myParam5);
+		virtual _Initializer * copy(void * place, std::size_t size) const {
+			return _copyInitializer(*this, place, size);
 		}
 
 		void execute(_StateInstance & instance) {
@@ -1393,8 +2166,8 @@ namespace Macho {
 			, myParam6(p6)
 		{}
 
-		virtual _Initializer * clone() {
-			return new _Initializer6<S, P1, P2, P3, P4, P5, P6>(myParam1, myParam2, myParam3, myParam4, myParam5, myParam6);
+		virtual _Initializer * copy(void * place, std::size_t size) const {
+			return _copyInitializer(*this, place, size);
 		}
 
 		void execute(_StateInstance & instance) {
@@ -1416,6 +2189,15 @@ namespace Macho {
 	static _HistoryInitializer _theHistoryInitializer;
 
 
+	////////////////////////////////////////////////////////////////////////////////
+	// Receives machine's data at the end of each step (see PublishedBox).
+	class _BoxPublisher {
+	public:
+		virtual ~_BoxPublisher() {}
+		virtual void publish() = 0;
+	};
+
+
 	////////////////////////////////////////////////////////////////////////////////
 	// Base class for Machine objects.
 	class _MachineBase {
@@ -1423,7 +2205,8 @@ namespace Macho {
 		class Alias currentState() const;
 
 	protected:
-		_MachineBase();
+		// 'queueSize' is capacity of event queue (a power of two).
+		_MachineBase(unsigned long queueSize);
 		~_MachineBase();
 
 		// Transition to new state.
@@ -1443,17 +2226,63 @@ namespace Macho {
 			myPendingInit = init;
 		}
 
+		// Copy initializer object into one of the machine's initializer places
+		// if it fits (no heap allocation then), otherwise onto heap.
+		_Initializer * createInitializer(const _Initializer & initializer) {
+			for (int i = 0; i < 2; ++i) {
+				if (!myPlacedInitializers[i]) {
+					void * place = myInitializerPlaces[i].place();
+					_Initializer * copy = initializer.copy(place, sizeof(myInitializerPlaces[i]));
+					if (copy == place)
+						myPlacedInitializers[i] = copy;
+					return copy;
+				}
+			}
+
+			return initializer.copy(0, 0);
+		}
+
+		// Dispose of initializer object after use.
+		void destroyInitializer(_Initializer * initializer) {
+			for (int i = 0; i < 2; ++i) {
+				if (myPlacedInitializers[i] == initializer) {
+					initializer->~_Initializer();
+					myPlacedInitializers[i] = 0;
+					return;
+				}
+			}
+
+			initializer->destroy();
+		}
+
 		// Provide event object to be executed on current state.
+		// Events are queued and executed in order of arrival, before those
+		// posted by other threads (never refused, unlike these).
 		void setPendingEvent(_IEventBase * event) {
 			assert(event);
-			assert(!myPendingEvent && "There is already an event pending!");
+			assert(!myInTransition && "Entry/Exit actions may not dispatch events!");
 
-			myPendingEvent = event;
+			myDispatched.push(event);
+		}
+
+		// Queue event object for the thread running the machine.
+		// Returns false if queue is full.
+		bool postEvent(_IEventBase * event) {
+			return myEvents.push(event);
 		}
 
 		// Performs pending state transition.
 		void rattleOn();
 
+		// Performs pending state transition, without dispatching queued
+		// events.
+		void transit();
+
+		// Is there a transition or event for 'rattleOn' to perform?
+		bool isPending() const {
+			return myPendingState || !myDispatched.empty() || !myEvents.empty();
+		}
+
 		// Get StateInstance object for ID.
 		_StateInstance * & getInstance(ID id) {
 			return myInstances[id];
@@ -1472,22 +2301,84 @@ namespace Macho {
 		// resources.
 		void shutdown();
 
-		// Allocate space for pointers to StateInstance objects.
-		void allocate(unsigned int count);
+		// Allocate space for pointers to StateInstance objects and arena of
+		// 'arenaSize' bytes for the objects themselves.
+		void allocate(unsigned int count, std::size_t arenaSize);
 
-		// Free all StateInstance objects.
+		// Free all StateInstance objects (arena is kept for reuse).
 		void free(unsigned int count);
 
-		void clearHistoryDeep(unsigned int count, const _StateInstance & instance);
+		// Make current state visible to 'published' (only thread running the
+		// machine publishes).
+		void publish() {
+			unsigned long publications = myPublications.getRelaxed();
+			myPublications.set(publications + 1);
+			myPublishedState.set(myCurrentState ? myCurrentState->myID : 0);
+			myPublications.set(publications + 2);
+
+			if (myBoxPublisher)
+				myBoxPublisher->publish();
+		}
+
+		// Published state and number of completed 'rattleOn' runs it is the
+		// result of, read consistently from any thread without locking.
+		unsigned long published(ID & state) const {
+			for (;;) {
+				unsigned long publications = myPublications.get();
+				state = myPublishedState.get();
+				if (!(publications & 1) && publications == myPublications.get())
+					return publications / 2;
+			}
+		}
+
+#ifdef MACHO_FLYWEIGHT
+		// Machine whose states run on this thread (see _RunningMachine).
+		static _MachineBase * & running() {
+#ifdef MACHO_THREADS
+			static thread_local _MachineBase * theMachine = 0;
+#else
+			static _MachineBase * theMachine = 0;
+#endif
+			return theMachine;
+		}
+#endif
+
+		// Address in arena.
+		void * arena(std::size_t offset) {
+			assert(myArena);
+			return myArena + offset;
+		}
+
+		// Clear history of states [first, last) (a subtree, see _KeyTable).
+		void clearHistoryDeep(const ID * first, const ID * last) {
+			for (; first != last; ++first) {
+				_HistoryID & history = myHistories[*first];
+				if (history) {
+					history = 0;
+#ifdef MACHO_SNAPSHOTS
+					change(*first);
+#endif
+				}
+			}
+		}
 
 #ifdef MACHO_SNAPSHOTS
-		// Create a copy of another machines StateInstance objects (includes boxes).
-		void copy(_StateInstance ** other, unsigned int count);
+		// Box or history of state changed since latest snapshot.
+		void change(ID id) {
+			unsigned long & word = myChanged[id / BITS];
+			unsigned long bit = 1UL << (id % BITS);
+			if (!(word & bit)) {
+				word |= bit;
+				myChanges[myChangeCount++] = id;
+			}
+		}
 
-		// Create a copy of another machines StateInstance object.
-		_StateInstance * createClone(ID id, _StateInstance * original);
+		// Forget changes: current configuration is in a snapshot now.
+		// Returns generation of the snapshot (see Snapshot).
+		unsigned long checkpoint();
 #endif
 
+
 	protected:
 		// C++ needs something like package visibility
 
@@ -1511,6 +2402,14 @@ namespace Macho {
 		// for setPendingState
 		friend class _StateInstance;
 
+		// for arena
+		template<class S>
+		friend class _SubstateInstance;
+		friend class _RootInstance;
+
+		// for running
+		friend class _RunningMachine;
+
 		// for Tests
 		friend class ::TestAccess;
 
@@ -1521,16 +2420,157 @@ namespace Macho {
 		_StateInstance * myPendingState;
 		_Initializer * myPendingInit;
 
+		// Places for initializers of parametrized transitions. There are two,
+		// because init action run by one initializer may initiate the next
+		// transition.
+		_Initializer * myPlacedInitializers[2];
+		_Storage<MACHO_INITIALIZER_SIZE> myInitializerPlaces[2];
+
 		// Deprecated!
 		void * myPendingBox;
 
-		_IEventBase * myPendingEvent;
+		// Events waiting for execution: dispatched by handlers, and posted.
+		_EventFifo myDispatched;
+		_EventQueue myEvents;
+
+		// Set while performing exit/entry/init actions.
+		bool myInTransition;
+
+#ifdef MACHO_SNAPSHOTS
+		// Set while restoring a snapshot: 'shutdown' keeps queued events.
+		bool myKeepEvents;
+#endif
 
 		// Array of StateInstance objects.
 		_StateInstance ** myInstances;
+
+		// Memory for StateInstance and state objects (see _KeyTable).
+		char * myArena;
+
+		// Boxes, reused box heap memory and history (ID, 0 for none) of
+		// states, indexed by state ID.
+		void ** myBoxes;
+		void ** myBoxPlaces;
+		_HistoryID * myHistories;
+
+#ifdef MACHO_SNAPSHOTS
+		// Boxes shared with snapshots (see _SharedBox), by state ID.
+		_SharedBox ** myShares;
+
+		// States changed since latest snapshot, as bitmap and as list
+		// (for delta snapshots).
+		enum { BITS = sizeof(unsigned long) * 8 };
+		unsigned long * myChanged;
+		ID * myChanges;
+		ID myChangeCount;
+
+		// Generation of latest snapshot taken of or restored to machine,
+		// and the machine it was taken of.
+		unsigned long myGenerations;
+		unsigned long myLatestGeneration;
+		const _MachineBase * myLatestMachine;
+#endif
+
+		// Current state ID as of the last completed 'rattleOn' (0 if not
+		// running), for other threads. Count of publications is odd while
+		// one is written.
+		_AtomicValue<ID> myPublishedState;
+		_AtomicValue<unsigned long> myPublications;
+
+		// Publishes box too if set.
+		_BoxPublisher * myBoxPublisher;
+	};
+
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Implementation for _StateInstance (machine specific data)
+	inline void * & _StateInstance::boxSlot() const {
+		return myMachine.myBoxes[myID];
+	}
+
+	inline void * & _StateInstance::boxPlace() const {
+		return myMachine.myBoxPlaces[myID];
+	}
+
+#ifdef MACHO_SNAPSHOTS
+	inline _SharedBox * & _StateInstance::shareSlot() const {
+		return myMachine.myShares[myID];
+	}
+
+	inline void _StateInstance::changed() const {
+		myMachine.change(myID);
+	}
+#endif
+
+	inline void _StateInstance::setHistory(_StateInstance * history) const {
+#ifdef MACHO_SNAPSHOTS
+		_HistoryID & slot = myMachine.myHistories[myID];
+		_HistoryID id = _HistoryID(history ? history->myID : 0);
+		if (slot != id) {
+			slot = id;
+			myMachine.change(myID);
+		}
+#else
+		myMachine.myHistories[myID] = _HistoryID(history ? history->myID : 0);
+#endif
+	}
+
+	inline _StateInstance * _StateInstance::history() const {
+		ID history = myMachine.myHistories[myID];
+		return history ? myMachine.getInstance(history) : 0;
+	}
+
+
+	////////////////////////////////////////////////////////////////////////////////
+	// With MACHO_FLYWEIGHT defined there is only one object of every state
+	// class, shared by all machines of its type: these find their machine
+	// by asking which one is running on the current thread.
+	// Objects of this class make a machine the running one while they live
+	// (after 'enter' is called for default constructed ones). Does nothing
+	// without MACHO_FLYWEIGHT.
+	class _RunningMachine {
+	public:
+#ifdef MACHO_FLYWEIGHT
+		_RunningMachine() : myPrevious(0), myEntered(false) {}
+
+		explicit _RunningMachine(_MachineBase & machine) : myPrevious(0), myEntered(false) {
+			enter(machine);
+		}
+
+		~_RunningMachine() {
+			if (myEntered)
+				_MachineBase::running() = myPrevious;
+		}
+
+		void enter(_MachineBase & machine) {
+			if (myEntered) return;
+
+			myPrevious = _MachineBase::running();
+			_MachineBase::running() = &machine;
+			myEntered = true;
+		}
+
+	private:
+		_MachineBase * myPrevious;
+		bool myEntered;
+#else
+		_RunningMachine() {}
+		explicit _RunningMachine(_MachineBase & machine) {}
+		void enter(_MachineBase & machine) {}
+#endif
 	};
 
 
+	inline _MachineBase & _StateSpecification::_machine() {
+#ifdef MACHO_FLYWEIGHT
+		assert(_MachineBase::running() && "State used outside of its machine!");
+		return *_MachineBase::running();
+#else
+		return _myStateInstance.machine();
+#endif
+	}
+
+
 	////////////////////////////////////////////////////////////////////////////////
 	// This is the base class for state aliases. A state alias represents a
 	// state of a machine. A transition to that state can be initiated by
@@ -1553,6 +2593,7 @@ namespace Macho {
 			assert(key);
 		}
 
+		// Takes ownership of heap allocated initializer.
 		Alias(Key key, _Initializer * init)
 			: myStateKey(key)
 			, myInitializer(init)
@@ -1560,24 +2601,45 @@ namespace Macho {
 			assert(key);
 		}
 
+		// Keeps copy of initializer (inside alias if it fits).
+		Alias(Key key, const _Initializer & init)
+			: myStateKey(key)
+			, myInitializer(init.copy(myPlace.place(), sizeof(myPlace)))
+		{
+			assert(key);
+		}
+
 		Alias(const Alias & other)
 			: myStateKey(other.myStateKey)
-			, myInitializer(other.myInitializer->clone())
+			, myInitializer(other.myInitializer->copy(myPlace.place(), sizeof(myPlace)))
 		{}
 
+#if __cplusplus >= 201103L
+		// Heap allocated initializers change owner, others are copied.
+		Alias(Alias && other)
+			: myStateKey(other.myStateKey)
+			, myInitializer(other.myInitializer)
+		{
+			if (other.isPlaced())
+				myInitializer = other.myInitializer->copy(myPlace.place(), sizeof(myPlace));
+			else
+				other.myInitializer = &_theDefaultInitializer;
+		}
+#endif
+
 		Alias & operator=(const Alias & other) {
 			if (this == &other) return *this;
 
-			myInitializer->destroy();
+			release();
 
 			myStateKey = other.myStateKey;
-			myInitializer = other.myInitializer->clone();
+			myInitializer = other.myInitializer->copy(myPlace.place(), sizeof(myPlace));
 
 			return *this;
 		}
 
 		~Alias() {
-			myInitializer->destroy();
+			release();
 		}
 
 		operator Key() const {
@@ -1585,11 +2647,11 @@ namespace Macho {
 		}
 
 		bool isChild(Key k) const {
-			return key()->childPredicate(k);
+			return key()->isChild(static_cast<_KeyData *>(k));
 		}
 
 		bool isParent(Key k) const {
-			return static_cast<_KeyData *>(k)->childPredicate(key());
+			return static_cast<_KeyData *>(k)->isChild(key());
 		}
 
 		const char * name() const {
@@ -1608,12 +2670,24 @@ namespace Macho {
 
 		_KeyData * key() const { return static_cast<_KeyData *>(myInitializer->adapt(myStateKey)); }
 
+		bool isPlaced() const { return myInitializer == static_cast<const void *>(&myPlace); }
+
+		void release() {
+			if (isPlaced())
+				myInitializer->~_Initializer();
+			else
+				myInitializer->destroy();
+		}
+
 	protected:
 		// Key of specified state.
 		Key myStateKey;
 
 		// Initializer of this alias.
 		_Initializer * myInitializer;
+
+		// Place for initializer, if it fits.
+		_Storage<MACHO_INITIALIZER_SIZE> myPlace;
 	};
 
 	// Deprecated: alias for Alias
@@ -1628,32 +2702,32 @@ namespace Macho {
 
 	template<class S, class P1>
 	Alias State(const P1 & p1) {
-		return Alias(S::key(), new _Initializer1<S, P1>(p1));
+		return Alias(S::key(), _Initializer1<S, P1>(p1));
 	}
 
 	template<class S, class P1, class P2>
 	Alias State(const P1 & p1, const P2 & p2) {
-		return Alias(S::key(), new _Initializer2<S, P1, P2>(p1, p2));
+		return Alias(S::key(), _Initializer2<S, P1, P2>(p1, p2));
 	}
 
 	template<class S, class P1, class P2, class P3>
 	Alias State(const P1 & p1, const P2 & p2, const P3 & p3) {
-		return Alias(S::key(), new _Initializer3<S, P1, P2, P3>(p1, p2, p3));
+		return Alias(S::key(), _Initializer3<S, P1, P2, P3>(p1, p2, p3));
 	}
 
 	template<class S, class P1, class P2, class P3, class P4>
 	Alias State(const P1 & p1, const P2 & p2, const P3 & p3, const P4 & p4) {
-		return Alias(S::key(), new _Initializer4<S, P1, P2, P3, P4>(p1, p2, p3, p4));
+		return Alias(S::key(), _Initializer4<S, P1, P2, P3, P4>(p1, p2, p3, p4));
 	}
 
 	template<class S, class P1, class P2, class P3, class P4, class P5>
 	Alias State(const P1 & p1, const P2 & p2, const P3 & p3, const P4 & p4, const P5 & p5) {
-		return Alias(S::key(), new _Initializer5<S, P1, P2, P3, P4, P5>(p1, p2, p3, p4, p5));
+		return Alias(S::key(), _Initializer5<S, P1, P2, P3, P4, P5>(p1, p2, p3, p4, p5));
 	}
 
 	template<class S, class P1, class P2, class P3, class P4, class P5, class P6>
 	Alias State(const P1 & p1, const P2 & p2, const P3 & p3, const P4 & p4, const P5 & p5, const P6 & p6) {
-		return Alias(S::key(), new _Initializer6<S, P1, P2, P3, P4, P5, P6>(p1, p2, p3, p4, p5, p6));
+		return Alias(S::key(), _Initializer6<S, P1, P2, P3, P4, P5, P6>(p1, p2, p3, p4, p5, p6));
 	}
 
 	// Create alias for state's history: not the current history state, but
@@ -1661,7 +2735,7 @@ namespace Macho {
 	// different states during its life. Needs a machine instance to take history from.
 	template<class S>
 	Alias StateHistory(const _MachineBase & machine) {
-		return Alias(S::key(), new _AdaptingInitializer(machine));
+		return Alias(S::key(), _AdaptingInitializer(machine));
 	}
 
 
@@ -1673,21 +2747,52 @@ namespace Macho {
 	// Assign a snapshot to a machine (operator=) to restore state.
 	// Note that no exit/entry actions of the overwritten machine state are performed!
 	// Box destructors however are executed!
+	// Boxes are not copied but shared with the machine, which copies a box
+	// only when a state changes it (copy on write): taking a snapshot costs
+	// about the same for any box size.
+	// Reference counts are not atomic: use snapshots on the machine's thread.
+	// A delta snapshot records only states whose box or history changed since
+	// its base, the latest snapshot taken of (or restored to) the machine:
+	// its cost depends on changes, not on number of states. The base must
+	// live as long as the delta. With any other base all states are recorded.
 #ifdef MACHO_SNAPSHOTS
 	template<class TOP>
-	class Snapshot : public _MachineBase {
+	class Snapshot {
 	public:
 		Snapshot(Machine<TOP> & machine);
+		Snapshot(Machine<TOP> & machine, const Snapshot<TOP> & base);
+		~Snapshot();
 
-		~Snapshot() {
-			free(Machine<TOP>::theStateCount);
-		}
+		// Number of states recorded (all of them if not a delta).
+		ID size() const { return mySize; }
 
 	private:
 		friend class Machine<TOP>;
 
 		Snapshot(const Snapshot<TOP> & other);
 		Snapshot & operator=(const Snapshot<TOP> & other);
+
+		// Record box and history of state at 'index'.
+		void record(Machine<TOP> & machine, ID id, ID index);
+
+		// Fill arrays indexed by state ID: base's records, then own ones.
+		void resolve(void ** boxes, _SharedBox ** shares, _HistoryID * histories) const;
+
+		// Machine taken of and its generation of snapshot (see
+		// _MachineBase::checkpoint).
+		const _MachineBase * myMachine;
+		unsigned long myGeneration;
+
+		const Snapshot<TOP> * myBase;
+		ID myCurrent;
+
+		// Records: state IDs (0 if not a delta: index is ID), box (EmptyBox
+		// is not shared), its share and history.
+		ID mySize;
+		ID * myIDs;
+		void ** myBoxes;
+		_SharedBox ** myShares;
+		_HistoryID * myHistories;
 	};
 #endif
 
@@ -1713,23 +2818,35 @@ namespace Macho {
 			AfterAdvice(Machine<TOP> & m) : myMachine(m) {}
 
 			// Event handler has finished execution. Execute pending transitions now.
-			~AfterAdvice() { myMachine.rattleOn(); }
+			~AfterAdvice() {
+				if (myMachine.isPending())
+					myMachine.rattleOn();
+				else
+					myMachine.publish();
+			}
 
 			// this arrow operator finally dispatches to TOP interface.
 			TOP * operator->() {
+				myRunning.enter(myMachine);
 				return static_cast<TOP *>(& (myMachine.myCurrentState->specification()) );
 			}
 
 		private:
 			Machine<TOP> & myMachine;
+
+			// Entered by arrow operator only: AfterAdvice may be copied before.
+			_RunningMachine myRunning;
 		};
 
 		// State machine instance can be initialized with a top state box.
-		Machine(typename TOP::Box * box = 0) {
+		Machine(typename TOP::Box * box = 0)
+			: _MachineBase(MACHO_EVENT_QUEUE_SIZE)
+		{
 			// Compile time check: TOP must directly derive from TopBase<TOP>
 			typedef typename _SameType<TopBase<TOP>, typename TOP::SUPER>::Check MustDeriveFromTopBase;
 
-			allocate(theStateCount);
+			allocate(theStateCount, keyTable().arenaSize());
+			createInstances(*this);
 
 			_StateInstance & top = TOP::_getInstance(*this);
 			top.setBox(box);
@@ -1739,11 +2856,14 @@ namespace Macho {
 
 		// Initialize with a state alias object to have machine go to a state
 		// other than TOP on startup. Box of top state may also be initialized.
-		Machine(const Alias & state, typename TOP::Box * box = 0) {
+		Machine(const Alias & state, typename TOP::Box * box = 0)
+			: _MachineBase(MACHO_EVENT_QUEUE_SIZE)
+		{
 			// Compile time check: TOP must directly derive from TopBase<TOP>
 			typedef typename _SameType<TopBase<TOP>, typename TOP::SUPER>::Check MustDeriveFromTopBase;
 
-			allocate(theStateCount);
+			allocate(theStateCount, keyTable().arenaSize());
+			createInstances(*this);
 
 			_StateInstance & top = TOP::_getInstance(*this);
 			top.setBox(box);
@@ -1753,34 +2873,36 @@ namespace Macho {
 
 #ifdef MACHO_SNAPSHOTS
 		// Create machine from a snapshot.
-		Machine(const Snapshot<TOP> & snapshot) {
-			allocate(theStateCount);
-			copy(snapshot.myInstances, theStateCount);
+		Machine(const Snapshot<TOP> & snapshot)
+			: _MachineBase(MACHO_EVENT_QUEUE_SIZE)
+		{
+			_RunningMachine running(*this);
+
+			allocate(theStateCount, keyTable().arenaSize());
+			createInstances(*this);
+			restore(snapshot);
 		}
 
 		// Overwrite current machine state by snapshot.
+		// Queued events are kept and dispatched to the restored state.
+		// StateInstance objects are kept, as are boxes not changed since
+		// the snapshot.
 		Machine<TOP> & operator=(const Snapshot<TOP> & snapshot) {
 			assert(!myPendingState);
-			assert(!myPendingEvent);
-
-			myCurrentState->shutdown();
-
-			free(theStateCount);
-			copy(snapshot.myInstances, theStateCount);
 
-			// Go to Root state first
-			myCurrentState = getInstance(0);
+			_RunningMachine running(*this);
 
-			// Then set previous current state
-			_StateInstance * current = getInstance(snapshot.myCurrentState->id());
-			current->restore(*current);
-			rattleOn();
+			myKeepEvents = true;
+			myCurrentState->shutdown();
+			myKeepEvents = false;
+			restore(snapshot);
 
 			return *this;
 		}
 #endif
 
 		~Machine() {
+			_RunningMachine running(*this);
 			myCurrentState->shutdown();
 			free(theStateCount);
 		}
@@ -1800,16 +2922,119 @@ namespace Macho {
 		void dispatch(IEvent<TOP> * event, bool destroy = true) {
 			assert(event);
 
+			_RunningMachine running(*this);
 			event->dispatch(*myCurrentState);
 			if (destroy) delete event;
 
 			rattleOn();
 		}
 
+		// Dispatch an event object stored by value (without heap usage).
+		template<unsigned int SIZE>
+		void dispatch(const InlineEvent<TOP, SIZE> & event) {
+			_RunningMachine running(*this);
+			event.dispatch(*myCurrentState);
+			rattleOn();
+		}
+
+		// Dispatch event objects of array [first, last) in order. Each event
+		// runs to completion (including transitions and events dispatched by
+		// it) before the next is dispatched, just like with repeated calls to
+		// 'dispatch', but work between events is only done when needed.
+		void dispatchBatch(IEvent<TOP> * const * first, IEvent<TOP> * const * last, bool destroy = true) {
+			assert(myCurrentState);
+			assert(!myPendingState);
+
+			_RunningMachine running(*this);
+			for (; first != last; ++first) {
+				_IEventBase * event = *first;
+				assert(event);
+
+				event->dispatch(*myCurrentState);
+				if (destroy) delete event;
+
+				if (isPending())
+					rattleOn();
+			}
+
+			publish();
+		}
+
+		template<unsigned int SIZE>
+		void dispatchBatch(const InlineEvent<TOP, SIZE> * first, const InlineEvent<TOP, SIZE> * last) {
+			assert(myCurrentState);
+			assert(!myPendingState);
+
+			_RunningMachine running(*this);
+			for (; first != last; ++first) {
+				first->dispatch(*myCurrentState);
+
+				if (isPending())
+					rattleOn();
+			}
+
+			publish();
+		}
+
+		// Queue an event object for the machine. Unlike 'dispatch' this may be
+		// called from any thread (lock-free with MACHO_THREADS defined).
+		// The event is dispatched (and deleted) by the thread running the
+		// machine, on the next call to 'processQueue' or after the next event
+		// handled by it, in order of arrival.
+		// Returns false if queue is full: the event is not taken over then.
+		bool post(IEvent<TOP> * event) {
+			assert(event);
+			return postEvent(event);
+		}
+
+		// Dispatch all queued events (only from the thread running the machine).
+		void processQueue() {
+			assert(myCurrentState);
+			rattleOn();
+		}
+
+		// Current state as published at the end of each dispatch (of an event,
+		// batch, direct call or the queue). Unlike 'currentState' these may be called from
+		// any thread while the machine runs, without locks: watchdogs and
+		// metrics see the state as it was after the last step.
+		// ID of published state (0 before start and after shutdown).
+		ID publishedState() const {
+			ID state;
+			published(state);
+			return state;
+		}
+
+		// Number of completed steps; 'state' receives published state.
+		unsigned long publishedState(ID & state) const {
+			return published(state);
+		}
+
+		// Is published state S or one of its substates?
+		template<class S>
+		bool isPublished() const {
+			return S::isPublished(*this);
+		}
+
+		// Find key of state by ID or name (0 if no state of this machine type
+		// has it), e.g. to restore persisted states: 'Alias(key)' is the state.
+		static Key findState(ID id) {
+			return keyTable().find(id);
+		}
+
+		static Key findState(const char * name) {
+			return keyTable().find(name);
+		}
+
+		// Usage of memory pool for event objects of this machine type
+		// (of calling thread with MACHO_THREADS).
+		static PoolStatistics eventPoolStatistics() {
+			return IEvent<TOP>::pool().statistics();
+		}
+
 		// Allow (const) access to top state's box (for state data extraction).
 		const typename TOP::Box & box() const {
 			assert(myCurrentState);
-			return static_cast<TOP &>(myCurrentState->specification()).TOP::box();
+			return *static_cast<typename TOP::Box *>(getInstance(StateID<TOP>::value)->box());
 		}
 
 	private:
@@ -1822,9 +3047,67 @@ namespace Macho {
 
 #ifdef MACHO_SNAPSHOTS
 		friend class Snapshot<TOP>;
+
+		// Take boxes (shared) and history of snapshot, then go to its
+		// current state. Missing StateInstance objects are created.
+		void restore(const Snapshot<TOP> & snapshot);
+
+		// Create StateInstance object of state (superstates first).
+		_StateInstance & createInstance(ID id) {
+			return static_cast<_KeyData *>(keyTable().find(id))->instanceGenerator(*this);
+		}
 #endif
 
 		template<class T> friend class StateID;
+		template<class S> friend class _SubstateInstance;
+		friend class MachinePool<TOP>;
+		template<class T, class B> friend class PublishedBox;
+
+#ifdef MACHO_THREADS
+		friend class Scheduler<TOP>;
+#endif
+
+		// for Tests
+		friend class ::TestAccess;
+
+		// Assign ID to state and record it in key table.
+		static ID registerState(_KeyTable::KeyFn key, _KeyTable::NameFn name, std::size_t size) {
+			ID id = theStateCount++;
+
+			// Checked in all builds: truncated history would go to wrong states.
+			if (ID(_HistoryID(id)) != id) {
+				assert("Too many states for MACHO_HISTORY_ID" && false);
+				std::abort();
+			}
+			keyTable().insert(id, key, name, size);
+			return id;
+		}
+
+		static _KeyTable & keyTable() {
+			static _KeyTable table;
+			return table;
+		}
+
+		// Key table numbering states in pre-order (on first use).
+		static const _KeyTable & orderedKeyTable() {
+			static const _KeyTable & table = keyTable().order();
+			return table;
+		}
+
+		// With MACHO_THREADS all StateInstance objects (and keys of all states)
+		// are created when a machine is constructed, not on first use: looking
+		// them up never allocates then. Current state and history are still
+		// written by the thread running the machine, so 'isCurrent', 'history'
+		// and 'clearHistory' are not safe from other threads; these use
+		// 'publishedState' or 'S::isPublished' instead.
+#ifdef MACHO_THREADS
+		static void createInstances(_MachineBase & machine) {
+			for (ID id = 1; id < theStateCount; ++id)
+				static_cast<_KeyData *>(keyTable().find(id))->instanceGenerator(machine);
+		}
+#else
+		static void createInstances(_MachineBase &) {}
+#endif
 
 		// Next free identifier for StateInstance objects.
 		static ID theStateCount;
@@ -1834,71 +3117,1143 @@ namespace Macho {
 	template<class TOP>
 	ID Machine<TOP>::theStateCount = 1;
 
-	// Each state has a unique ID number.
-	// The identifiers are consecutive integers starting from zero,
-	// which allows use as index into a vector for fast access.
-	// 'Root' always has zero as id.
-	template<class S>
-	const ID StateID<S>::value = Machine<typename S::TOP>::theStateCount++;
-
 
 	////////////////////////////////////////////////////////////////////////////////
-	// Implementation for StateSpecification
+	// Copy of a machine's top state box (or of a projection of it, type T),
+	// published at the end of each step of the machine (see publishedState)
+	// for readers on other threads. Readers get consistent copies without
+	// locking (seqlock: writer marks a copy in progress by an odd count of
+	// publications, readers retry then). T must be trivially copyable.
+	// At most one per machine; it must be created and destroyed by the
+	// thread running the machine, and not outlive it.
+	template<class TOP, class T = typename TOP::Box>
+	class PublishedBox : private _BoxPublisher {
+	public:
+		typedef void (*Projection)(const typename TOP::Box & box, T & value);
 
-	// Initiate state transition with 0 to six parameters.
-	template<class S>
-	inline void _StateSpecification::setState() {
-		_MachineBase & m = _myStateInstance.machine();
-		_StateInstance & instance = S::_getInstance(m);
-		m.setPendingState(instance, &_theDefaultInitializer);
-	}
+		// Without projection T must be TOP::Box (checked at compile time).
+		explicit PublishedBox(Machine<TOP> & machine)
+			: myMachine(machine)
+			, myProjection(&copy)
+			, myPublications(0)
+		{
+			typedef typename _SameType<T, typename TOP::Box>::Check OtherTypeThanBoxNeedsProjection;
+			start();
+		}
 
-	template<class S, class P1>
-	inline void _StateSpecification::setState(const P1 & p1) {
-		_MachineBase & m = _myStateInstance.machine();
-		_StateInstance & instance = S::_getInstance(m);
-		m.setPendingState(instance, new _Initializer1<S, P1>(p1));
-	}
+		PublishedBox(Machine<TOP> & machine, Projection projection)
+			: myMachine(machine)
+			, myProjection(projection)
+			, myPublications(0)
+		{
+			assert(projection);
+			start();
+		}
 
-	template<class S, class P1, class P2>
-	inline void _StateSpecification::setState(const P1 & p1, const P2 & p2) {
-		_MachineBase & m = _myStateInstance.machine();
-		_StateInstance & instance = S::_getInstance(m);
-		m.setPendingState(instance, new _Initializer2<S, P1, P2>(p1, p2));
-	}
+		~PublishedBox() {
+			myMachine.myBoxPublisher = 0;
+		}
+
+		// Latest published value, from any thread.
+		T get() const {
+			T value;
+			get(value);
+			return value;
+		}
+
+		// Returns number of publications so far.
+		unsigned long get(T & value) const {
+			unsigned long words[WORDS];
+
+			for (;;) {
+				unsigned long publications = myPublications.get();
+				for (unsigned int i = 0; i < WORDS; ++i)
+					words[i] = myWords[i].get();
+
+				if (!(publications & 1) && publications == myPublications.get()) {
+					std::memcpy(&value, words, sizeof(T));
+					return publications / 2;
+				}
+			}
+		}
+
+	private:
+		enum { WORDS = (sizeof(T) + sizeof(unsigned long) - 1) / sizeof(unsigned long) };
+
+		void start() {
+#if __cplusplus >= 201103L
+			static_assert(std::is_trivially_copyable<T>::value, "Published box must be trivially copyable");
+#endif
+			assert(!myMachine.myBoxPublisher);
+			myMachine.myBoxPublisher = this;
+			publish();
+		}
+
+		// Copy box to words (machine has a top box while it is running).
+		void publish() {
+			if (!myMachine.myCurrentState || !myMachine.myCurrentState->isChild(TOP::key()))
+				return;
+
+			T value;
+			myProjection(myMachine.box(), value);
+
+			unsigned long words[WORDS] = { 0 };
+			std::memcpy(words, &value, sizeof(T));
+
+			unsigned long publications = myPublications.getRelaxed();
+			myPublications.set(publications + 1);
+			for (unsigned int i = 0; i < WORDS; ++i)
+				myWords[i].set(words[i]);
+			myPublications.set(publications + 2);
+		}
+
+		// Projection of box onto itself.
+		static void copy(const typename TOP::Box & box, T & value) {
+			value = box;
+		}
+
+		PublishedBox(const PublishedBox & other);
+		PublishedBox & operator=(const PublishedBox & other);
+
+		Machine<TOP> & myMachine;
+		const Projection myProjection;
+
+		_AtomicValue<unsigned long> myPublications;
+		_AtomicValue<unsigned long> myWords[WORDS];
+	};
+
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Container for large numbers of machines of the same type, referred to by
+	// handles. Machine data is stored column by column: current state IDs of
+	// all machines in one dense array, boxes, reused box memory and history in
+	// one row per machine of dense arrays indexed by state ID.
+	// StateInstance and state objects exist only once per pool and are shared
+	// by its machines: the pool points them at the data of the machine it is
+	// running.
+	// Events are dispatched synchronously, by handle. Events dispatched by
+	// event handlers go to the machine handling the event.
+	// The pool keeps an index of the machines in each state (updated when a
+	// dispatch is complete), to count or visit machines by state without
+	// looking at other machines.
+	template<class TOP>
+	class MachinePool : public _MachineBase {
+	public:
+		typedef unsigned long Handle;
+
+		MachinePool()
+			: _MachineBase(MACHO_EVENT_QUEUE_SIZE)
+			, myStates(Machine<TOP>::theStateCount)
+			, myCurrent(0)
+			, myRowBoxes(0)
+			, myRowPlaces(0)
+			, myRowHistories(0)
+			, myMembers(new Members[Machine<TOP>::theStateCount])
+			, myPositions(0)
+			, myFree(0)
+			, myFreeCount(0)
+			, myUsed(0)
+			, myCapacity(0)
+			, mySize(0)
+		{
+			// Compile time check: TOP must directly derive from TopBase<TOP>
+			typedef typename _SameType<TopBase<TOP>, typename TOP::SUPER>::Check MustDeriveFromTopBase;
+
+			allocate(myStates, Machine<TOP>::keyTable().arenaSize());
+			Machine<TOP>::createInstances(*this);
+
+			// Used while no machine is running.
+			myHomeBoxes = myBoxes;
+			myHomePlaces = myBoxPlaces;
+			myHomeHistories = myHistories;
+		}
+
+		~MachinePool() {
+			for (Handle h = 0; h < myUsed; ++h) {
+				if (contains(h))
+					remove(h);
+			}
+
+			myBoxes = myHomeBoxes;
+			myBoxPlaces = myHomePlaces;
+			myHistories = myHomeHistories;
+			free(myStates);
+
+			delete[] myCurrent;
+			delete[] myRowBoxes;
+			delete[] myRowPlaces;
+			delete[] myRowHistories;
+			delete[] myFree;
+
+			for (ID id = 0; id < myStates; ++id)
+				delete[] myMembers[id].handles;
+			delete[] myMembers;
+			delete[] myPositions;
+		}
+
+		// Add machine starting in top state. Box of top state may be given.
+		Handle add(typename TOP::Box * box = 0) {
+			Handle h = newRow();
+
+			_StateInstance & top = TOP::_getInstance(*this);
+			top.setBox(box);
+			start(top);
+
+			store(h);
+			return h;
+		}
+
+		// Add machine starting in state given by alias.
+		Handle add(const Alias & state, typename TOP::Box * box = 0) {
+			Handle h = newRow();
+
+			_StateInstance & top = TOP::_getInstance(*this);
+			top.setBox(box);
+			start(state);
+
+			store(h);
+			return h;
+		}
+
+		// Remove machine: exit actions are performed, boxes freed.
+		// Its handle may be reused for machines added later.
+		void remove(Handle h) {
+			assert(contains(h));
+			select(h);
+
+			{
+				_RunningMachine running(*this);
+				myCurrentState->shutdown();
+			}
+
+			// Persistent boxes and reused box memory.
+			for (ID id = 0; id < myStates; ++id) {
+				if (myBoxes[id]) {
+					getInstance(id)->deleteBox();
+					myBoxes[id] = 0;
+				}
+
+				if (myBoxPlaces[id]) {
+					::operator delete(myBoxPlaces[id]);
+					myBoxPlaces[id] = 0;
+				}
+
+				myHistories[id] = 0;
+			}
+
+			leave(h, myCurrent[h]);
+			myCurrent[h] = 0;
+			myFree[myFreeCount++] = h;
+			--mySize;
+		}
+
+		// Dispatch an event object to machine.
+		void dispatch(Handle h, IEvent<TOP> * event, bool destroy = true) {
+			assert(contains(h));
+			assert(event);
+			select(h);
+
+			{
+				_RunningMachine running(*this);
+				static_cast<_IEventBase *>(event)->dispatch(*myCurrentState);
+				if (destroy) delete event;
+			}
+
+			if (isPending())
+				rattleOn();
+
+			store(h);
+		}
+
+		// Dispatch an event object stored by value.
+		template<unsigned int SIZE>
+		void dispatch(Handle h, const InlineEvent<TOP, SIZE> & event) {
+			assert(contains(h));
+			select(h);
+
+			{
+				_RunningMachine running(*this);
+				event.dispatch(*myCurrentState);
+			}
+
+			if (isPending())
+				rattleOn();
+
+			store(h);
+		}
+
+		// Dispatch event object to every machine in state (or one of its
+		// substates), grouped by exact state so that the same handlers run
+		// one after another. Machines getting into the state meanwhile do
+		// not receive the event. Returns number of machines reached.
+		unsigned long broadcast(Key state, IEvent<TOP> * event, bool destroy = true) {
+			assert(event);
+
+			unsigned long count;
+			Handle * handles = collect(state, count);
+			for (unsigned long i = 0; i < count; ++i)
+				dispatch(handles[i], event, false);
+
+			delete[] handles;
+			if (destroy) delete event;
+
+			return count;
+		}
+
+		template<class S>
+		unsigned long broadcast(IEvent<TOP> * event, bool destroy = true) {
+			return broadcast(S::key(), event, destroy);
+		}
+
+		template<unsigned int SIZE>
+		unsigned long broadcast(Key state, const InlineEvent<TOP, SIZE> & event) {
+			unsigned long count;
+			Handle * handles = collect(state, count);
+			for (unsigned long i = 0; i < count; ++i)
+				dispatch(handles[i], event);
+
+			delete[] handles;
+			return count;
+		}
+
+		template<class S, unsigned int SIZE>
+		unsigned long broadcast(const InlineEvent<TOP, SIZE> & event) {
+			return broadcast(S::key(), event);
+		}
+
+		// Is there a machine for handle?
+		bool contains(Handle h) const {
+			return h < myUsed && myCurrent[h] != 0;
+		}
+
+		// Number of machines in pool.
+		unsigned long size() const {
+			return mySize;
+		}
+
+		// Current state of machine.
+		Alias currentState(Handle h) const {
+			assert(contains(h));
+			return Alias(Machine<TOP>::findState(myCurrent[h]));
+		}
+
+		// Is machine in state S (or one of its substates)?
+		template<class S>
+		bool isCurrent(Handle h) const {
+			assert(contains(h));
+			return static_cast<_KeyData *>(Machine<TOP>::findState(myCurrent[h]))->isChild(static_cast<_KeyData *>(S::key()));
+		}
+
+		// Allow (const) access to top state's box of machine.
+		const typename TOP::Box & box(Handle h) const {
+			assert(contains(h));
+			return *static_cast<typename TOP::Box *>(myRowBoxes[h * myStates + StateID<TOP>::value]);
+		}
+
+		// Number of machines in state (or one of its substates).
+		// Linear in number of states, not machines.
+		unsigned long count(Key state) const {
+			unsigned long count = 0;
+			for (ID id = 1; id < myStates; ++id) {
+				if (myMembers[id].count && isChild(id, state))
+					count += myMembers[id].count;
+			}
+
+			return count;
+		}
+
+		template<class S>
+		unsigned long count() const {
+			return count(S::key());
+		}
+
+		// Call visitor with handle of each machine in state (or one of its
+		// substates), grouped by exact state. The visitor must not add,
+		// remove or dispatch to machines of the pool.
+		template<class F>
+		F members(Key state, F visitor) const {
+			for (ID id = 1; id < myStates; ++id) {
+				const Members & members = myMembers[id];
+				if (members.count && isChild(id, state)) {
+					for (unsigned long i = 0; i < members.count; ++i)
+						visitor(members.handles[i]);
+				}
+			}
+
+			return visitor;
+		}
+
+		template<class S, class F>
+		F members(F visitor) const {
+			return members(S::key(), visitor);
+		}
+
+		// Bytes of memory used per machine (not counting boxes).
+		std::size_t rowSize() const {
+			return sizeof(ID) + myStates * (2 * sizeof(void *) + sizeof(_HistoryID)) +
+				sizeof(Handle) + 2 * sizeof(unsigned long);
+		}
+
+	private:
+		// Make machine's data the data of StateInstance objects.
+		void select(Handle h) {
+			assert(h < myUsed);
+
+			myBoxes = myRowBoxes + h * myStates;
+			myBoxPlaces = myRowPlaces + h * myStates;
+			myHistories = myRowHistories + h * myStates;
+			myCurrentState = getInstance(myCurrent[h]);
+		}
+
+		// Save current state of running machine.
+		void store(Handle h) {
+			assert(myCurrentState);
+
+			ID current = myCurrentState->id();
+			if (current != myCurrent[h]) {
+				leave(h, myCurrent[h]);
+				join(h, current);
+				myCurrent[h] = current;
+			}
+		}
+
+		// Is state of ID a substate of state (or the state itself)?
+		static bool isChild(ID id, Key state) {
+			return static_cast<_KeyData *>(Machine<TOP>::findState(id))->isChild(static_cast<_KeyData *>(state));
+		}
+
+		// Copy of handles of machines in state (or one of its substates),
+		// grouped by exact state.
+		Handle * collect(Key state, unsigned long & count) const {
+			count = this->count(state);
+			Handle * handles = new Handle[count];
+
+			unsigned long i = 0;
+			for (ID id = 1; id < myStates; ++id) {
+				const Members & members = myMembers[id];
+				if (members.count && isChild(id, state)) {
+					for (unsigned long j = 0; j < members.count; ++j)
+						handles[i++] = members.handles[j];
+				}
+			}
+
+			assert(i == count);
+			return handles;
+		}
+
+		// Add machine to members of state.
+		void join(Handle h, ID id) {
+			Members & members = myMembers[id];
+			if (members.count == members.capacity) {
+				unsigned long capacity = members.capacity ? 2 * members.capacity : 16;
+				Handle * handles = new Handle[capacity];
+				for (unsigned long i = 0; i < members.count; ++i)
+					handles[i] = members.handles[i];
+
+				delete[] members.handles;
+				members.handles = handles;
+				members.capacity = capacity;
+			}
+
+			myPositions[h] = members.count;
+			members.handles[members.count++] = h;
+		}
+
+		// Remove machine from members of state (0 for none): last member
+		// takes its place.
+		void leave(Handle h, ID id) {
+			if (!id) return;
+
+			Members & members = myMembers[id];
+			Handle last = members.handles[--members.count];
+			members.handles[myPositions[h]] = last;
+			myPositions[last] = myPositions[h];
+		}
+
+		// Find room for a new machine and select it.
+		Handle newRow() {
+			Handle h;
+			if (myFreeCount) {
+				h = myFree[--myFreeCount];
+			} else {
+				if (myUsed == myCapacity)
+					grow();
+				h = myUsed++;
+			}
+
+			++mySize;
+			myCurrent[h] = 0;
+
+			select(h);
+			myCurrentState = 0;
+			return h;
+		}
+
+		void grow() {
+			Handle capacity = myCapacity ? 2 * myCapacity : 64;
+
+			ID * current = new ID[capacity];
+			void ** boxes = new void *[capacity * myStates];
+			void ** places = new void *[capacity * myStates];
+			_HistoryID * histories = new _HistoryID[capacity * myStates];
+			Handle * free = new Handle[capacity];
+			unsigned long * positions = new unsigned long[capacity];
+
+			for (Handle h = 0; h < capacity; ++h) {
+				current[h] = h < myCapacity ? myCurrent[h] : 0;
+				positions[h] = h < myCapacity ? myPositions[h] : 0;
+			}
+
+			for (Handle i = 0; i < capacity * myStates; ++i) {
+				bool old = i < myCapacity * myStates;
+				boxes[i] = old ? myRowBoxes[i] : 0;
+				places[i] = old ? myRowPlaces[i] : 0;
+				histories[i] = old ? myRowHistories[i] : 0;
+			}
+
+			for (Handle i = 0; i < myFreeCount; ++i)
+				free[i] = myFree[i];
+
+			delete[] myCurrent;
+			delete[] myRowBoxes;
+			delete[] myRowPlaces;
+			delete[] myRowHistories;
+			delete[] myFree;
+			delete[] myPositions;
+
+			myCurrent = current;
+			myRowBoxes = boxes;
+			myRowPlaces = places;
+			myRowHistories = histories;
+			myFree = free;
+			myPositions = positions;
+			myCapacity = capacity;
+		}
+
+	private:
+		MachinePool(const MachinePool<TOP> & other);
+		MachinePool<TOP> & operator=(const MachinePool<TOP> & other);
+
+		// Number of states (row length).
+		const ID myStates;
+
+		// Current state of machines (0 for free rows).
+		ID * myCurrent;
+
+		// Rows of machine data.
+		void ** myRowBoxes;
+		void ** myRowPlaces;
+		_HistoryID * myRowHistories;
+
+		// Handles of machines in each state (by ID).
+		struct Members {
+			Members() : handles(0), count(0), capacity(0) {}
+
+			Handle * handles;
+			unsigned long count;
+			unsigned long capacity;
+		};
+
+		Members * myMembers;
+
+		// Position of machines in members of their current state.
+		unsigned long * myPositions;
+
+		// Data of no machine.
+		void ** myHomeBoxes;
+		void ** myHomePlaces;
+		_HistoryID * myHomeHistories;
+
+		// Rows of removed machines.
+		Handle * myFree;
+		Handle myFreeCount;
+
+		Handle myUsed;
+		Handle myCapacity;
+		unsigned long mySize;
+	};
+
+
+#ifdef MACHO_THREADS
+	////////////////////////////////////////////////////////////////////////////////
+	// Runs machines of the same type on a number of worker threads (needs
+	// MACHO_THREADS). Machines are named by keys chosen by the user; a key
+	// determines the shard (worker thread with a MachinePool) owning the
+	// machine. All work for a machine is done by its shard's thread, in order
+	// of posting, so a machine never runs concurrently and needs no locks.
+	// Adding and removing machines and posting events may be done from any
+	// thread: these only queue work for the shard.
+	template<class TOP>
+	class Executor {
+	public:
+		typedef unsigned long MachineKey;
+
+		explicit Executor(unsigned int threads)
+			: myThreads(threads)
+			, myShards(new Shard[threads])
+		{
+			assert(threads > 0);
+
+			for (unsigned int i = 0; i < myThreads; ++i)
+				myShards[i].thread = std::thread(&Executor::work, std::ref(myShards[i]));
+		}
+
+		// Finishes queued work, removes all machines and stops threads.
+		~Executor() {
+			for (unsigned int i = 0; i < myThreads; ++i) {
+				Shard & shard = myShards[i];
+				{
+					std::lock_guard<std::mutex> lock(shard.mutex);
+					shard.stop = true;
+				}
+				shard.ready.notify_one();
+				shard.thread.join();
+			}
+
+			delete[] myShards;
+		}
+
+		// Add machine starting in top state (box is taken over if given).
+		// Ignored if key is in use (box is deleted then).
+		void add(MachineKey key, typename TOP::Box * box = 0) {
+			queue(key, Message(Message::ADD, key, 0, box));
+		}
+
+		// Remove machine: exit actions are performed, boxes freed.
+		void remove(MachineKey key) {
+			queue(key, Message(Message::REMOVE, key, 0, 0));
+		}
+
+		// Queue event object for machine (it is deleted after dispatch).
+		void post(MachineKey key, IEvent<TOP> * event) {
+			assert(event);
+			queue(key, Message(Message::EVENT, key, event, 0));
+		}
+
+		// Wait until all work queued so far is done.
+		void wait() {
+			for (unsigned int i = 0; i < myThreads; ++i) {
+				Shard & shard = myShards[i];
+				std::unique_lock<std::mutex> lock(shard.mutex);
+				while (shard.done != shard.queued)
+					shard.idle.wait(lock);
+			}
+		}
+
+		unsigned int threads() const {
+			return myThreads;
+		}
+
+		// Shard of machine with key.
+		unsigned int shard(MachineKey key) const {
+			return (unsigned int) (key % myThreads);
+		}
+
+		// Number of machines in state (or one of its substates). Waits
+		// for each shard to finish work queued so far: its worker leaves
+		// the pool alone then, until it takes the next messages (under lock).
+		unsigned long count(Key state) const {
+			unsigned long count = 0;
+			for (unsigned int i = 0; i < myThreads; ++i) {
+				Shard & shard = myShards[i];
+				std::unique_lock<std::mutex> lock(shard.mutex);
+				while (shard.done != shard.queued)
+					shard.idle.wait(lock);
+
+				count += shard.pool.count(state);
+			}
+			return count;
+		}
+
+		template<class S>
+		unsigned long count() const {
+			return count(S::key());
+		}
+
+		// Number of events handled by a shard.
+		unsigned long handled(unsigned int shard) const {
+			assert(shard < myThreads);
+			std::lock_guard<std::mutex> lock(myShards[shard].mutex);
+			return myShards[shard].handled;
+		}
+
+	private:
+		typedef typename MachinePool<TOP>::Handle Handle;
+
+		struct Message {
+			enum Kind { ADD, REMOVE, EVENT };
+
+			Message(Kind kind, MachineKey key, IEvent<TOP> * event, typename TOP::Box * box)
+				: kind(kind), key(key), event(event), box(box)
+			{}
+
+			Kind kind;
+			MachineKey key;
+			IEvent<TOP> * event;
+			typename TOP::Box * box;
+		};
+
+		// Worker thread with its machines and queued messages.
+		struct Shard {
+			Shard() : queued(0), done(0), handled(0), stop(false) {}
+
+			mutable std::mutex mutex;
+			std::condition_variable ready;
+			std::condition_variable idle;
+
+			// Guarded by mutex.
+			std::vector<Message> inbox;
+			unsigned long queued;
+			unsigned long done;
+			unsigned long handled;
+			bool stop;
+
+			// Only used by worker thread (and by 'count' while it is idle).
+			MachinePool<TOP> pool;
+			std::unordered_map<MachineKey, Handle> handles;
+
+			std::thread thread;
+		};
+
+		void queue(MachineKey key, const Message & message) {
+			Shard & shard = myShards[this->shard(key)];
+
+			bool wake;
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				wake = shard.inbox.empty();
+				shard.inbox.push_back(message);
+				++shard.queued;
+			}
+
+			// Worker only waits for an empty inbox.
+			if (wake)
+				shard.ready.notify_one();
+		}
+
+		// Worker thread: takes all queued messages at once and handles them.
+		static void work(Shard & shard) {
+			std::vector<Message> batch;
+			unsigned long handled = 0;
+
+			for (;;) {
+				{
+					std::unique_lock<std::mutex> lock(shard.mutex);
+					shard.done += batch.size();
+					shard.handled += handled;
+					if (shard.done == shard.queued)
+						shard.idle.notify_all();
+
+					while (shard.inbox.empty() && !shard.stop)
+						shard.ready.wait(lock);
+
+					if (shard.inbox.empty())
+						break;
+
+					batch.clear();
+					batch.swap(shard.inbox);
+					handled = 0;
+				}
+
+				for (typename std::vector<Message>::const_iterator i = batch.begin(); i != batch.end(); ++i) {
+					if (i->kind == Message::ADD) {
+						// Key in use: keep machine, which is known by key.
+						if (shard.handles.find(i->key) != shard.handles.end())
+							delete i->box;
+						else
+							shard.handles[i->key] = shard.pool.add(i->box);
+						continue;
+					}
+
+					typename std::unordered_map<MachineKey, Handle>::iterator machine = shard.handles.find(i->key);
+					if (machine == shard.handles.end()) {
+						// Machine removed (or never added): drop message.
+						delete i->event;
+						continue;
+					}
+
+					if (i->kind == Message::EVENT) {
+						shard.pool.dispatch(machine->second, i->event);
+						++handled;
+					} else {
+						shard.pool.remove(machine->second);
+						shard.handles.erase(machine);
+					}
+				}
+			}
+
+			for (typename std::unordered_map<MachineKey, Handle>::iterator i = shard.handles.begin(); i != shard.handles.end(); ++i)
+				shard.pool.remove(i->second);
+			shard.handles.clear();
+		}
+
+		Executor(const Executor<TOP> & other);
+		Executor<TOP> & operator=(const Executor<TOP> & other);
+
+		const unsigned int myThreads;
+		Shard * myShards;
+	};
+
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Runs machines on a number of worker threads, balancing skewed loads
+	// (needs MACHO_THREADS). Each machine has its own event queue (see
+	// Machine::post); a machine with queued events is ready and is put on the
+	// deque of a worker. Workers take ready machines from their own deque and
+	// handle all their queued events; idle workers steal ready machines from
+	// other workers. Whole machines are moved, never single events: a machine
+	// is only ever run by one worker at a time, in order of its events.
+	template<class TOP>
+	class Scheduler {
+		struct Entry;
+
+	public:
+		typedef Entry * Handle;
+
+		// Usage of a worker.
+		struct Statistics {
+			unsigned long runs;		// Machines run (including stolen ones)
+			unsigned long steals;	// Machines stolen from other workers
+			unsigned long depth;	// Ready machines on deque now
+			unsigned long maxDepth;	// Most ready machines on deque at once
+		};
+
+		explicit Scheduler(unsigned int threads)
+			: myThreads(threads)
+			, myWorkers(new Worker[threads])
+			, myNextHome(0)
+			, myReady(0)
+			, myPending(0)
+			, myIdle(0)
+			, myStop(false)
+		{
+			assert(threads > 0);
+
+			for (unsigned int i = 0; i < myThreads; ++i) {
+				myWorkers[i].index = i;
+				myWorkers[i].thread = std::thread(&Scheduler::work, this, std::ref(myWorkers[i]));
+			}
+		}
+
+		// Finishes queued events, stops threads and deletes machines.
+		~Scheduler() {
+			wait();
+
+			{
+				std::lock_guard<std::mutex> lock(mySleep);
+				myStop = true;
+			}
+			myWake.notify_all();
+
+			for (unsigned int i = 0; i < myThreads; ++i)
+				myWorkers[i].thread.join();
+
+			delete[] myWorkers;
+
+			for (typename std::vector<Entry *>::iterator i = myEntries.begin(); i != myEntries.end(); ++i) {
+				delete (*i)->machine;
+				delete *i;
+			}
+		}
+
+		// Add machine (started by the calling thread). Box of top state may
+		// be given.
+		Handle add(typename TOP::Box * box = 0) {
+			return add(new Machine<TOP>(box));
+		}
+
+		Handle add(const Alias & state, typename TOP::Box * box = 0) {
+			return add(new Machine<TOP>(state, box));
+		}
+
+		// Queue event object for machine, from any thread. Machine gets ready
+		// on the deque of the posting worker or else on its home worker's.
+		// Returns false if machine's queue is full: event is not taken over then.
+		bool post(Handle h, IEvent<TOP> * event) {
+			assert(h);
+			if (!h->machine->post(event))
+				return false;
+
+			// If machine is still scheduled, its worker sees the event after
+			// unscheduling it (exchanges synchronize).
+			++myPending;
+			if (h->scheduled.exchange(true)) {
+				--myPending;
+				return true;
+			}
+
+			Worker * worker = current();
+			push(worker ? *worker : myWorkers[h->home], h);
+			return true;
+		}
+
+		// Wait until all events queued so far are handled.
+		void wait() {
+			std::unique_lock<std::mutex> lock(mySleep);
+			while (myPending != 0)
+				myDone.wait(lock);
+		}
+
+		unsigned int threads() const {
+			return myThreads;
+		}
+
+		Statistics statistics(unsigned int worker) const {
+			assert(worker < myThreads);
+			Worker & w = myWorkers[worker];
+
+			std::lock_guard<std::mutex> lock(w.mutex);
+			Statistics statistics;
+			statistics.runs = w.runs;
+			statistics.steals = w.steals;
+			statistics.depth = w.ready.size();
+			statistics.maxDepth = w.maxDepth;
+			return statistics;
+		}
+
+		// Machine, for inspection while it is not running (after 'wait').
+		const Machine<TOP> & machine(Handle h) const {
+			assert(h);
+			return *h->machine;
+		}
+
+	private:
+		struct Entry {
+			Machine<TOP> * machine;
+			unsigned int home;
+
+			// Set while machine is ready or running.
+			std::atomic<bool> scheduled;
+		};
+
+		struct Worker {
+			Worker() : index(0), runs(0), steals(0), maxDepth(0) {}
+
+			unsigned int index;
+
+			// Guard ready machines and statistics.
+			mutable std::mutex mutex;
+			std::deque<Entry *> ready;
+			unsigned long runs;
+			unsigned long steals;
+			unsigned long maxDepth;
+
+			std::thread thread;
+		};
+
+		Handle add(Machine<TOP> * machine) {
+			Entry * entry = new Entry;
+			entry->machine = machine;
+			entry->scheduled = false;
+
+			std::lock_guard<std::mutex> lock(mySleep);
+			entry->home = myNextHome++ % myThreads;
+			myEntries.push_back(entry);
+			return entry;
+		}
+
+		// Worker of this scheduler running on calling thread (0 if none).
+		Worker * current() const {
+			const Scheduler * scheduler = running().first;
+			return scheduler == this ? running().second : 0;
+		}
+
+		static std::pair<const Scheduler *, Worker *> & running() {
+			static thread_local std::pair<const Scheduler *, Worker *> theRunning(0, 0);
+			return theRunning;
+		}
+
+		void push(Worker & worker, Entry * entry) {
+			{
+				std::lock_guard<std::mutex> lock(worker.mutex);
+				worker.ready.push_back(entry);
+				if (worker.ready.size() > worker.maxDepth)
+					worker.maxDepth = worker.ready.size();
+			}
+
+			++myReady;
+			if (myIdle != 0) {
+				std::lock_guard<std::mutex> lock(mySleep);
+				myWake.notify_one();
+			}
+		}
+
+		// Own ready machines are taken most recent first (while they are
+		// likely in cache), stolen ones oldest first.
+		Entry * take(Worker & worker) {
+			{
+				std::lock_guard<std::mutex> lock(worker.mutex);
+				if (!worker.ready.empty()) {
+					Entry * entry = worker.ready.back();
+					worker.ready.pop_back();
+					++worker.runs;
+					--myReady;
+					return entry;
+				}
+			}
+
+			for (unsigned int i = 1; i < myThreads; ++i) {
+				Worker & victim = myWorkers[(worker.index + i) % myThreads];
+				Entry * entry = 0;
+				{
+					std::lock_guard<std::mutex> lock(victim.mutex);
+					if (victim.ready.empty())
+						continue;
+
+					entry = victim.ready.front();
+					victim.ready.pop_front();
+				}
+
+				--myReady;
+				std::lock_guard<std::mutex> lock(worker.mutex);
+				++worker.runs;
+				++worker.steals;
+				return entry;
+			}
+
+			return 0;
+		}
+
+		void work(Worker & worker) {
+			running() = std::make_pair(static_cast<const Scheduler *>(this), &worker);
+
+			for (;;) {
+				Entry * entry = take(worker);
+				if (entry) {
+					run(worker, entry);
+					continue;
+				}
+
+				std::unique_lock<std::mutex> lock(mySleep);
+				++myIdle;
+				while (myReady == 0 && !myStop)
+					myWake.wait(lock);
+				--myIdle;
+
+				if (myReady == 0 && myStop)
+					break;
+			}
+		}
+
+		// Handle all queued events of machine.
+		void run(Worker & worker, Entry * entry) {
+			entry->machine->processQueue();
+
+			// Another worker may take machine once unscheduled.
+			unsigned long position = entry->machine->myEvents.popPosition();
+			entry->scheduled.exchange(false);
+
+			// Event posted meanwhile (its poster saw machine scheduled).
+			if (!entry->machine->myEvents.empty(position) && !entry->scheduled.exchange(true)) {
+				push(worker, entry);
+				return;
+			}
+
+			if (--myPending == 0) {
+				std::lock_guard<std::mutex> lock(mySleep);
+				myDone.notify_all();
+			}
+		}
+
+		Scheduler(const Scheduler<TOP> & other);
+		Scheduler<TOP> & operator=(const Scheduler<TOP> & other);
+
+		const unsigned int myThreads;
+		Worker * myWorkers;
+
+		// Guards machines, home assignment and sleeping.
+		std::mutex mySleep;
+		std::condition_variable myWake;
+		std::condition_variable myDone;
+		std::vector<Entry *> myEntries;
+		unsigned int myNextHome;
+
+		// Ready machines on all deques.
+		std::atomic<unsigned long> myReady;
+
+		// Machines ready or running.
+		std::atomic<unsigned long> myPending;
+
+		// Workers sleeping (or about to).
+		std::atomic<unsigned int> myIdle;
+
+		bool myStop;
+	};
+#endif
+
+	// Each state has a unique ID number.
+	// The identifiers are consecutive integers starting from zero,
+	// which allows use as index into a vector for fast access.
+	// 'Root' always has zero as id.
+	template<class S>
+	const ID StateID<S>::value = Machine<typename S::TOP>::registerState(&S::key, &S::_state_name, _SubstateInstance<S>::arenaSize());
+
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Implementation for _SubstateInstance
+	template<class S>
+	/* static */ inline void * _SubstateInstance<S>::place(_MachineBase & machine) {
+		return machine.arena(Machine<typename S::TOP>::keyTable().offset(StateID<S>::value));
+	}
+
+
+	////////////////////////////////////////////////////////////////////////////////
+	// Implementation for StateSpecification
+
+	// Initiate state transition with 0 to six parameters.
+	template<class S>
+	inline void _StateSpecification::setState() {
+		_MachineBase & m = _machine();
+		_StateInstance & instance = S::_getInstance(m);
+		m.setPendingState(instance, &_theDefaultInitializer);
+	}
+
+	template<class S, class P1>
+	inline void _StateSpecification::setState(const P1 & p1) {
+		_MachineBase & m = _machine();
+		_StateInstance & instance = S::_getInstance(m);
+		m.setPendingState(instance, m.createInitializer(_Initializer1<S, P1>(p1)));
+	}
+
+	template<class S, class P1, class P2>
+	inline void _StateSpecification::setState(const P1 & p1, const P2 & p2) {
+		_MachineBase & m = _machine();
+		_StateInstance & instance = S::_getInstance(m);
+		m.setPendingState(instance, m.createInitializer(_Initializer2<S, P1, P2>(p1, p2)));
+	}
 
 	template<class S, class P1, class P2, class P3>
 	inline void _StateSpecification::setState(const P1 & p1, const P2 & p2, const P3 & p3) {
-		_MachineBase & m = _myStateInstance.machine();
+		_MachineBase & m = _machine();
 		_StateInstance & instance = S::_getInstance(m);
-		m.setPendingState(instance, new _Initializer3<S, P1, P2, P3>(p1, p2, p3));
+		m.setPendingState(instance, m.createInitializer(_Initializer3<S, P1, P2, P3>(p1, p2, p3)));
 	}
 
 	template<class S, class P1, class P2, class P3, class P4>
 	inline void _StateSpecification::setState(const P1 & p1, const P2 & p2, const P3 & p3, const P4 & p4) {
-		_MachineBase & m = _myStateInstance.machine();
+		_MachineBase & m = _machine();
 		_StateInstance & instance = S::_getInstance(m);
-		m.setPendingState(instance, new _Initializer4<S, P1, P2, P3, P4>(p1, p2, p3, p4));
+		m.setPendingState(instance, m.createInitializer(_Initializer4<S, P1, P2, P3, P4>(p1, p2, p3, p4)));
 	}
 
 	template<class S, class P1, class P2, class P3, class P4, class P5>
 	inline void _StateSpecification::setState(const P1 & p1, const P2 & p2, const P3 & p3, const P4 & p4, const P5 & p5) {
-		_MachineBase & m = _myStateInstance.machine();
+		_MachineBase & m = _machine();
 		_StateInstance & instance = S::_getInstance(m);
-		m.setPendingState(instance, new _Initializer5<S, P1, P2, P3, P4, P5>(p1, p2, p3, p4, p5));
+		m.setPendingState(instance, m.createInitializer(_Initializer5<S, P1, P2, P3, P4, P5>(p1, p2, p3, p4, p5)));
 	}
 
 	template<class S, class P1, class P2, class P3, class P4, class P5, class P6>
 	inline void _StateSpecification::setState(const P1 & p1, const P2 & p2, const P3 & p3, const P4 & p4, const P5 & p5, const P6 & p6) {
-		_MachineBase & m = _myStateInstance.machine();
+		_MachineBase & m = _machine();
 		_StateInstance & instance = S::_getInstance(m);
-		m.setPendingState(instance, new _Initializer6<S, P1, P2, P3, P4, P5, P6>(p1, p2, p3, p4, p5, p6));
+		m.setPendingState(instance, m.createInitializer(_Initializer6<S, P1, P2, P3, P4, P5, P6>(p1, p2, p3, p4, p5, p6)));
 	}
 
 	// Initiate state transition to a state's history.
 	template<class S>
 	inline void _StateSpecification::setStateHistory() {
-		_MachineBase & m = _myStateInstance.machine();
+		_MachineBase & m = _machine();
 		_StateInstance & instance = S::_getInstance(m);
 		m.setPendingState(instance, &_theHistoryInitializer);
 	}
@@ -1906,7 +4261,7 @@ namespace Macho {
 	// Deprecated!
 	template<class S>
 	inline void _StateSpecification::setStateBox(typename S::Box * box) {
-		_MachineBase & m = _myStateInstance.machine();
+		_MachineBase & m = _machine();
 		_StateInstance & instance = S::_getInstance(m);
 		m.myPendingBox = box;
 		m.setPendingState(instance, &_theHistoryInitializer);
@@ -1915,7 +4270,7 @@ namespace Macho {
 	// Deprecated!
 	template<class S>
 	inline void _StateSpecification::setStateDirect(typename S::Box * box) {
-		_MachineBase & m = _myStateInstance.machine();
+		_MachineBase & m = _machine();
 		_StateInstance & instance = S::_getInstance(m);
 		m.myPendingBox = box;
 		m.setPendingState(instance, &_theDefaultInitializer);
@@ -1927,19 +4282,35 @@ namespace Macho {
 	template<class T>
 	inline void TopBase<T>::dispatch(IEvent<TOP> * event) {
 		assert(event);
-		_myStateInstance.machine().setPendingEvent(event);
+		this->_machine().setPendingEvent(event);
 	}
 
 	template<class T>
 	// Returns current state machine instance.
 	inline _MachineBase & TopBase<T>::machine() {
-		return this->_myStateInstance.machine();
+		return this->_machine();
 	}
 
 
 	////////////////////////////////////////////////////////////////////////////////
 	// Implementation for Link
 	template<class C, class P>
+#ifdef MACHO_FLYWEIGHT
+	inline Link<C, P>::Link(_StateInstance & instance)
+		// StateInstance objects are created by _getInstance, superstates first.
+		: P(instance)
+	{}
+
+	// Box of state in running machine.
+	template<class C, class P>
+	inline void * Link<C, P>::_box() {
+#ifdef MACHO_SNAPSHOTS
+		return this->_machine().getInstance(StateID<C>::value)->ownBox();
+#else
+		return this->_machine().getInstance(StateID<C>::value)->box();
+#endif
+	}
+#else
 	inline Link<C, P>::Link(_StateInstance & instance)
 		: P(P::_getInstance(instance.machine()))
 		// Can't initialize _myStateInstance with _getInstance,
@@ -1950,8 +4321,13 @@ namespace Macho {
 	// This method keeps '_myStateInstance' attribute private.
 	template<class C, class P>
 	inline void * Link<C, P>::_box() {
+#ifdef MACHO_SNAPSHOTS
+		return _myStateInstance.ownBox();
+#else
 		return _myStateInstance.box();
+#endif
 	}
+#endif
 
 	// Default behaviour: free box on exit.
 	template<class C, class P>
@@ -1966,14 +4342,22 @@ namespace Macho {
 		_StateInstance * & instance = machine.getInstance(StateID<C>::value);
 		if (!instance)
 			// Will create parent StateInstance object if not already created.
-			instance = new _SubstateInstance<C>(machine, &P::_getInstance(machine));
+			instance = new (_SubstateInstance<C>::place(machine)) _SubstateInstance<C>(machine, &P::_getInstance(machine));
 
 		return *instance;
 	}
 
 	template<class C, class P>
 	/* static */ inline bool Link<C, P>::isCurrent(const _MachineBase & machine) {
-		return machine.currentState().isChild(key());
+		return machine.myCurrentState->isChild(key());
+	}
+
+	template<class C, class P>
+	/* static */ inline bool Link<C, P>::isPublished(const _MachineBase & machine) {
+		ID state;
+		machine.published(state);
+		Key current = Machine<TOP>::findState(state);
+		return current && static_cast<_KeyData *>(current)->isChild(static_cast<_KeyData *>(key()));
 	}
 
 	// Deprecated!
@@ -1991,9 +4375,10 @@ namespace Macho {
 
 	template<class C, class P>
 	/* static */ void Link<C, P>::clearHistoryDeep(_MachineBase & machine) {
-		const _StateInstance * instance = machine.getInstance(StateID<C>::value);
-		if (instance)
-			machine.clearHistoryDeep(Machine<TOP>::theStateCount, *instance);
+		const ID * first;
+		const ID * last;
+		Machine<TOP>::orderedKeyTable().subtree(StateID<C>::value, first, last);
+		machine.clearHistoryDeep(first, last);
 	}
 
 	template<class C, class P>
@@ -2009,7 +4394,11 @@ namespace Macho {
 
 	template<class C, class P>
 	/* static */ inline Key Link<C, P>::key() {
-		static _KeyData k = { _getInstance, isChild, C::_state_name, StateID<C>::value };
+		static const _KeyData * path[_DEPTH + 1];
+		static _KeyData k = {
+			_getInstance, C::_state_name, StateID<C>::value,
+			_DEPTH, _KeyData::buildPath(path, P::_keyPath(), _DEPTH, &k)
+		};
 		return &k;
 	}
 
@@ -2023,15 +4412,167 @@ namespace Macho {
 	// Implementation for Snapshot
 #ifdef MACHO_SNAPSHOTS
 	template<class TOP>
-	Snapshot<TOP>::Snapshot(Machine<TOP> & machine) {
+	Snapshot<TOP>::Snapshot(Machine<TOP> & machine)
+		: myMachine(&machine)
+		, myGeneration(0)
+		, myBase(0)
+		, myCurrent(0)
+		, mySize(Machine<TOP>::theStateCount)
+		, myIDs(0)
+		, myBoxes(new void *[mySize])
+		, myShares(new _SharedBox *[mySize])
+		, myHistories(new _HistoryID[mySize])
+	{
 		assert(!machine.myPendingState);
-		assert(!machine.myPendingEvent);
 		assert(machine.myCurrentState);
 
-		allocate(Machine<TOP>::theStateCount);
-		copy(machine.myInstances, Machine<TOP>::theStateCount);
+		myCurrent = machine.myCurrentState->id();
+
+		for (ID id = 0; id < mySize; ++id)
+			record(machine, id, id);
+
+		myGeneration = machine.checkpoint();
+	}
+
+	template<class TOP>
+	Snapshot<TOP>::Snapshot(Machine<TOP> & machine, const Snapshot<TOP> & base)
+		: myMachine(&machine)
+		, myGeneration(0)
+		, myBase(0)
+		, myCurrent(0)
+		, mySize(Machine<TOP>::theStateCount)
+		, myIDs(0)
+		, myBoxes(0)
+		, myShares(0)
+		, myHistories(0)
+	{
+		assert(!machine.myPendingState);
+		assert(machine.myCurrentState);
+
+		myCurrent = machine.myCurrentState->id();
+
+		// Changes are known since latest snapshot only: record all states
+		// for any other base.
+		bool latest = base.myMachine == machine.myLatestMachine &&
+			base.myGeneration == machine.myLatestGeneration;
+		if (latest) {
+			myBase = &base;
+			mySize = machine.myChangeCount;
+			myIDs = new ID[mySize];
+		}
+
+		myBoxes = new void *[mySize];
+		myShares = new _SharedBox *[mySize];
+		myHistories = new _HistoryID[mySize];
+
+		for (ID i = 0; i < mySize; ++i) {
+			ID id = myIDs ? machine.myChanges[i] : i;
+			if (myIDs)
+				myIDs[i] = id;
+			record(machine, id, i);
+		}
+
+		myGeneration = machine.checkpoint();
+	}
+
+	template<class TOP>
+	Snapshot<TOP>::~Snapshot() {
+		for (ID i = 0; i < mySize; ++i)
+			if (myShares[i])
+				myShares[i]->release();
+
+		delete[] myIDs;
+		delete[] myBoxes;
+		delete[] myShares;
+		delete[] myHistories;
+	}
+
+	template<class TOP>
+	void Snapshot<TOP>::record(Machine<TOP> & machine, ID id, ID index) {
+		_StateInstance * instance = machine.getInstance(id);
+		void * box = instance ? machine.myBoxes[id] : 0;
+
+		myBoxes[index] = box;
+		myShares[index] = 0;
+		myHistories[index] = machine.myHistories[id];
+
+		if (box && box != &_EmptyBox::theEmptyBox)
+			myShares[index] = instance->shareBox();
+	}
+
+	template<class TOP>
+	void Snapshot<TOP>::resolve(void ** boxes, _SharedBox ** shares, _HistoryID * histories) const {
+		if (!myBase) {
+			std::memcpy(boxes, myBoxes, mySize * sizeof(void *));
+			std::memcpy(shares, myShares, mySize * sizeof(_SharedBox *));
+			std::memcpy(histories, myHistories, mySize * sizeof(_HistoryID));
+			return;
+		}
+
+		myBase->resolve(boxes, shares, histories);
+		for (ID i = 0; i < mySize; ++i) {
+			ID id = myIDs[i];
+			boxes[id] = myBoxes[i];
+			shares[id] = myShares[i];
+			histories[id] = myHistories[i];
+		}
+	}
+
+	template<class TOP>
+	void Machine<TOP>::restore(const Snapshot<TOP> & snapshot) {
+		const ID count = theStateCount;
+
+		void ** boxes = snapshot.myBoxes;
+		_SharedBox ** shares = snapshot.myShares;
+		const _HistoryID * histories = snapshot.myHistories;
+
+		// Delta: collect records along chain of bases.
+		void ** resolved = 0;
+		if (snapshot.myBase) {
+			resolved = new void *[count];
+			boxes = resolved;
+			shares = new _SharedBox *[count];
+			_HistoryID * resolvedHistories = new _HistoryID[count];
+			snapshot.resolve(boxes, shares, resolvedHistories);
+			histories = resolvedHistories;
+		}
+
+		// StateInstance objects for boxes, history and current state. Root
+		// comes with any of them.
+		for (ID id = 1; id < count; ++id) {
+			ID history = histories[id];
+			if (!getInstance(id) && (boxes[id] || history || id == snapshot.myCurrent))
+				createInstance(id);
+			if (history && !getInstance(history))
+				createInstance(history);
+		}
+
+		// Instances clear history when created: copy it afterwards.
+		std::memcpy(myHistories, histories, count * sizeof(_HistoryID));
+
+		// Boxes stay shared with snapshot until changed.
+		for (ID id = 1; id < count; ++id)
+			if (_StateInstance * instance = getInstance(id))
+				instance->restoreBox(boxes[id], shares[id]);
+
+		if (resolved) {
+			delete[] resolved;
+			delete[] shares;
+			delete[] histories;
+		}
+
+		// Machine is as in snapshot: base for next delta.
+		checkpoint();
+		myLatestGeneration = snapshot.myGeneration;
+		myLatestMachine = snapshot.myMachine;
+
+		// Go to Root state first
+		myCurrentState = getInstance(0);
 
-		myCurrentState = getInstance(machine.myCurrentState->id());
+		// Then set previous current state
+		_StateInstance * current = getInstance(snapshot.myCurrent);
+		current->restore(*current);
+		rattleOn();
 	}
 #endif
 
@@ -3,14 +3,22 @@
 // Compile like this:
 // (don't forget defining the MACHO_SNAPSHOTS symbol)
 // g++ -D MACHO_SNAPSHOTS Macho.cpp Test.cpp
+//
+// Add multithreading tests like this:
+// g++ -std=c++11 -pthread -D MACHO_SNAPSHOTS -D MACHO_THREADS Macho.cpp Test.cpp
 
 #include "Macho.hpp"
 
 #include <map>
+#include <set>
 #include <vector>
 #include <iostream>
 #include <string>
 
+#ifdef MACHO_THREADS
+#	include <thread>
+#endif
+
 using namespace std;
 
 
@@ -45,6 +53,7 @@ enum {
 namespace Transitions {
 
 	long boxes;
+	long box_copies;
 
 	void box_created(long state) {
 		boxes |= state;
@@ -132,6 +141,7 @@ namespace Transitions {
 	SUBSTATE(StateAAA, StateAA) {
 		struct Box {
 			Box() : data(0) {}
+			Box(const Box & other) : data(other.data) { ++box_copies; }
 			~Box() {}
 			int data;
 		};
@@ -437,6 +447,11 @@ namespace Dispatch {
 			assert(i == 3); assert(b);
 			box().push_back(EVENT3);
 		}
+		// Handles event of another machine in the middle of own handler.
+		virtual void forward(Macho::Machine<Top> * other) {
+			(*other)->event1(1);
+			box().push_back(EVENT2);
+		}
 	};
 
 
@@ -559,6 +574,179 @@ namespace Templates {
 } // namespace Templates
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Tests for event queue.
+namespace Queue {
+
+	TOPSTATE(Top) {
+		struct Box {
+			Box() : count(0) { for (int i = 0; i < 4; ++i) last[i] = -1; }
+
+			long count;
+			long last[4];
+			bool ordered;
+		};
+
+		STATE(Top)
+
+		virtual void event(int producer, long sequence) {
+			Box & b = box();
+			if (sequence != b.last[producer] + 1)
+				b.ordered = false;
+			b.last[producer] = sequence;
+			++b.count;
+		}
+
+		// Dispatches more than one event from a handler.
+		virtual void burst() {
+			dispatch(Event(&Top::event, 0, box().last[0] + 1));
+			dispatch(Event(&Top::event, 0, box().last[0] + 2));
+			dispatch(Event(&Top::event, 0, box().last[0] + 3));
+		}
+
+	private:
+		void init() { box().ordered = true; }
+	};
+
+} // namespace Queue
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Parametrized transitions, started from event handlers and init methods.
+namespace Initializers {
+
+	// Too large to fit the machine's initializer places.
+	struct Large {
+		Large(long value) { for (int i = 0; i < 32; ++i) data[i] = value; }
+		long data[32];
+	};
+
+	TOPSTATE(Top) {
+		struct Box {
+			Box() : sum(0) {}
+			long sum;
+		};
+
+		STATE(Top)
+
+		virtual void countdown(long n);
+		virtual void large(long value);
+	};
+
+	SUBSTATE(Ping, Top) {
+		STATE(Ping)
+	private:
+		void init(long n);
+	};
+
+	SUBSTATE(Pong, Ping) {
+		STATE(Pong)
+	private:
+		void init(long n, const char * name);
+	};
+
+	SUBSTATE(Pung, Pong) {
+		STATE(Pung)
+	private:
+		void init(long n);
+	};
+
+	SUBSTATE(Heavy, Top) {
+		STATE(Heavy)
+	private:
+		void init(Large large);
+	};
+
+	void Top::countdown(long n) { setState<Ping>(n); }
+	void Top::large(long value) { setState<Heavy>(Large(value)); }
+
+	// Each init starts the next transition while its own initializer is alive.
+	void Ping::init(long n) {
+		TOP::box().sum += n;
+		setState<Pong>(n - 1, (const char *) "pong");
+	}
+
+	void Pong::init(long n, const char * name) {
+		assert(name[0] == 'p');
+		TOP::box().sum += n;
+		setState<Pung>(n - 1);
+	}
+
+	void Pung::init(long n) { TOP::box().sum += n; }
+
+	void Heavy::init(Large large) { TOP::box().sum += large.data[31]; }
+
+} // namespace Initializers
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Machines in a pool.
+namespace Pool {
+
+	TOPSTATE(Top) {
+		struct Box {
+			Box() : ticks(0) {}
+			long ticks;
+		};
+
+		STATE(Top)
+
+		virtual void start() {}
+		virtual void stop() {}
+		virtual void tick() { ++box().ticks; }
+
+	private:
+		void init();
+	};
+
+	SUBSTATE(Idle, Top) {
+		STATE(Idle)
+
+		virtual void start();
+	};
+
+	SUBSTATE(Running, Top) {
+		STATE(Running)
+		HISTORY()
+
+		virtual void stop() { setState<Idle>(); }
+
+	private:
+		void init();
+	};
+
+	SUBSTATE(Fast, Running) {
+		STATE(Fast)
+
+		virtual void tick();
+	};
+
+	SUBSTATE(Slow, Running) {
+		struct Box {
+			Box() : ticks(0) {}
+			long ticks;
+		};
+
+		STATE(Slow)
+
+		// First tick queues another one.
+		virtual void tick() {
+			TOP::tick();
+			if (++box().ticks == 1)
+				dispatch(Event(&Top::tick));
+			else
+				setState<Fast>();
+		}
+	};
+
+	void Top::init() { setState<Idle>(); }
+	void Idle::start() { setStateHistory<Running>(); }
+	void Running::init() { setState<Fast>(); }
+	void Fast::tick() { TOP::tick(); setState<Slow>(); }
+
+} // namespace Pool
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Helper functions to access protected members
 class TestAccess {
@@ -582,9 +770,89 @@ public:
 		m.setState(T::_getInstance(m), &Macho::_theHistoryInitializer);
 	}
 
+	static int placedInitializers(const Macho::_MachineBase & m) {
+		return (m.myPlacedInitializers[0] != 0) + (m.myPlacedInitializers[1] != 0);
+	}
+
+	// Are all StateInstance and state objects in their arena slots?
+	// Shared state objects (MACHO_FLYWEIGHT) are outside of any machine.
+	template<class TOP>
+	static bool inArena(Macho::Machine<TOP> & m) {
+		const Macho::_KeyTable & table = Macho::Machine<TOP>::keyTable();
+		const char * end = m.myArena + table.arenaSize();
+
+		for (Macho::ID id = 0; id < Macho::Machine<TOP>::theStateCount; ++id) {
+			Macho::_StateInstance * instance = m.getInstance(id);
+			if (!instance)
+				continue;
+
+			const char * place = reinterpret_cast<char *>(instance);
+			const char * specification = reinterpret_cast<const char *>(&instance->specification());
+			bool inside = specification > place && specification < end;
+
+#ifdef MACHO_FLYWEIGHT
+			if (place != m.myArena + table.offset(id) || inside)
+#else
+			if (place != m.myArena + table.offset(id) || !inside)
+#endif
+				return false;
+		}
+
+		return true;
+	}
+
+	// History of S as stored by machine (ID of state, 0 for none).
+	template<class S>
+	static Macho::ID historyID(const Macho::Machine<typename S::TOP> & m) {
+		return m.myHistories[Macho::StateID<S>::value];
+	}
+
+	// Number of states of machine type TOP (Root included).
+	template<class TOP>
+	static std::size_t stateCount() {
+		return Macho::Machine<TOP>::theStateCount;
+	}
+
+	// Has machine created StateInstance object of S?
+	template<class S>
+	static bool hasInstance(const Macho::Machine<typename S::TOP> & m) {
+		return m.getInstance(Macho::StateID<S>::value) != 0;
+	}
+
+	// Are IDs of S's subtree exactly those of S and its substates?
+	template<class S>
+	static bool isSubtree() {
+		typedef Macho::Machine<typename S::TOP> M;
+		const Macho::ID * first;
+		const Macho::ID * last;
+		M::orderedKeyTable().subtree(Macho::StateID<S>::value, first, last);
+
+		std::set<Macho::ID> subtree(first, last);
+		if (subtree.size() != std::size_t(last - first))
+			return false;
+
+		for (Macho::ID id = 1; id < M::theStateCount; ++id) {
+			const Macho::_KeyData * key = static_cast<const Macho::_KeyData *>(M::findState(id));
+			if (key->isChild(static_cast<const Macho::_KeyData *>(S::key())) != (subtree.count(id) == 1))
+				return false;
+		}
+		return true;
+	}
+
 	template<typename T>
 	static typename T::Box * getBox(Macho::Machine<typename T::Top> & m) {
-		return & static_cast<T&>(m.myCurrentState->specification()).T::box();
+#ifdef MACHO_SNAPSHOTS
+		// Box is changed by tests: not shared with snapshots anymore.
+		return static_cast<typename T::Box *>(m.getInstance(Macho::StateID<T>::value)->ownBox());
+#else
+		return static_cast<typename T::Box *>(m.getInstance(Macho::StateID<T>::value)->box());
+#endif
+	}
+
+	// Box without taking it over from snapshots.
+	template<typename T>
+	static const void * peekBox(Macho::Machine<typename T::Top> & m) {
+		return m.getInstance(Macho::StateID<T>::value)->box();
 	}
 };
 
@@ -787,6 +1055,7 @@ void testTransitions() {
 	// Test machine snapshots
 	cout << endl << "Testing snapshots" << endl;
 	long old_boxes = boxes;
+	const void * shared = TestAccess::peekBox<StateCAA>(m);
 	Macho::Snapshot<Top> s(m);
 
 	for (int i = 0; i < 2; ++i) {
@@ -921,6 +1190,9 @@ void testTransitions() {
 		TestAccess::setState<StateB>(m);
 		m.box().clear();
 
+		assert(TestAccess::isSubtree<StateC>());
+		assert(TestAccess::isSubtree<StateCAB>());
+		assert(TestAccess::isSubtree<Top>());
 		StateC::clearHistoryDeep(m);
 		TestAccess::setState<StateC>(m);
 		assert(StateC::isCurrent(m));
@@ -952,19 +1224,110 @@ void testTransitions() {
 #ifdef MACHO_SNAPSHOTS
 		// Testing snapshots
 		if (i == 0) {
+			{
+				// New machine from snapshot
+				Macho::Machine<Top> copy(s);
+				assert(StateCAA::alias() == copy.currentState());
+				assert(TestAccess::peekBox<StateCAA>(copy) == shared);
+				assert(TestAccess::getBox<StateCAA>(copy)->data == 42);
+			}
+
+			// Delta snapshot records changes since s only
+			Macho::Snapshot<Top> d(m, s);
+			assert(d.size() > 0 && d.size() < s.size());
+
 			m = s;
 
 			assert(m.box().entries.empty());
 			assert(m.box().exits.empty());
 			assert(m.box().inits.empty());
+			// Boxes are shared with snapshot until changed
+			assert(TestAccess::peekBox<StateCAA>(m) == shared);
+			assert(TestAccess::getBox<StateCAA>(m) != shared);
+
 			// Test box content after snapshot restore
 			assert(TestAccess::getBox<StateCAA>(m)->data == 42);
 
+			// Forward to delta, then back again
+			m = d;
+			assert(StateAAA::alias() == m.currentState());
+			assert(TestAccess::getBox<StateAAA>(m)->data == 43);
+			m = s;
+			assert(StateCAA::alias() == m.currentState());
+			assert(TestAccess::getBox<StateAAA>(m)->data == 42);
+			{
+				// Base other than latest snapshot: all states recorded
+				Macho::Snapshot<Top> full(m, d);
+				assert(full.size() == s.size());
+			}
+
+			// Restoring again reuses memory of own box for next copy
+			const void * own = TestAccess::getBox<StateAAA>(m);
+			m = s;
+			assert(TestAccess::peekBox<StateAAA>(m) != own);
+			assert(TestAccess::getBox<StateAAA>(m) == own);
+
+			// Box of discarded snapshots is taken back without copy
+			for (int j = 0; j < 5; ++j)
+				Macho::Snapshot<Top> discarded(m);
+			long copies = box_copies;
+			assert(TestAccess::getBox<StateAAA>(m) == own);
+			assert(box_copies == copies);
+
 			boxes = old_boxes;
 			m.box().clear();
 		}
 	}
+
+	// Box taken back from a discarded snapshot after restore, then left
+	TestAccess::setState<StateCAA>(m);
+	TestAccess::getBox<StateCAA>(m)->data = 1;
+	{
+		Macho::Snapshot<Top> t(m);
+		TestAccess::getBox<StateCAA>(m)->data = 2;
+		m = t;
+	}
+	TestAccess::getBox<StateCAA>(m)->data = 3;
+	TestAccess::setState<StateB>(m);
+	m.box().clear();
+
+	{
+		// Memory of box kept by restore: reused by copy and entry, freed
+		// with machine.
+		Macho::Machine<Top> r;
+		TestAccess::setState<StateCAA>(r);
+		Macho::Snapshot<Top> v(r);
+		const void * own = TestAccess::getBox<StateCAA>(r);
+		r = v;
+		assert(TestAccess::peekBox<StateCAA>(r) != own);
+		assert(TestAccess::getBox<StateCAA>(r) == own);
+
+		r = v;
+		TestAccess::setState<StateB>(r);
+		TestAccess::setState<StateCAA>(r);
+		assert(TestAccess::peekBox<StateCAA>(r) == own);
+
+		r = v;
+	}
 #endif
+
+	// History is kept as state IDs: shallow history has the substate left,
+	// deep history the innermost state left.
+	TestAccess::setState<StateBAB>(m);
+	TestAccess::setState<StateCAB>(m);
+	assert(TestAccess::historyID<StateB>(m) == Macho::StateID<StateBA>::value);
+	assert(StateB::history(m) == StateBA::alias());
+	TestAccess::setState<StateA>(m);
+	assert(TestAccess::historyID<StateC>(m) == Macho::StateID<StateCAB>::value);
+	assert(StateC::history(m) == StateCAB::alias());
+	TestAccess::setStateHistory<StateC>(m);
+	assert(StateCAB::alias() == m.currentState());
+	TestAccess::setStateHistory<StateB>(m);
+	assert(StateBA::alias() == m.currentState());
+	m.box().clear();
+
+	// StateInstance and state objects are placed in the machine's arena.
+	assert(TestAccess::inArena(m));
 }
 
 
@@ -993,6 +1356,47 @@ void testDispatch() {
 	// Test if internal dispatch happens after switching to new state
 	m.dispatch(Event(&Top::event3, 3, true));
 	assert(m.box()[0] == EVENT3); assert(m.box()[1] == STATEA_ENTRY); assert(m.box()[2] == EVENT1);
+
+	// Test dispatching of event values
+	m->clear();
+	Macho::InlineEvent<Top> event1(&Top::event1, 1);
+	Macho::InlineEvent<Top, 32> event2(&Top::event2, 2, false);
+	Macho::InlineEvent<Top> event3(&Top::event3, 3, true);
+
+	std::vector<Macho::InlineEvent<Top> > events(2, event1);
+	events.push_back(event3);
+	events[1] = events[2];
+
+	m.dispatch(events[0]);
+	m.dispatch(event2);
+	m.dispatch(events[1]);
+	assert(m.box().size() == 5);
+	assert(m.box()[0] == EVENT1); assert(m.box()[1] == EVENT2); assert(m.box()[2] == EVENT3);
+	assert(m.box()[3] == STATEB_ENTRY); assert(m.box()[4] == EVENT1);
+
+	// Test dispatching of event batches
+	m->clear();
+	Macho::IEvent<Top> * batch[] = {
+		Event(&Top::event1, 1), Event(&Top::event3, 3, true), Event(&Top::event2, 2, false)
+	};
+	m.dispatchBatch(batch, batch + 3);
+	assert(m.box().size() == 5);
+	assert(m.box()[0] == EVENT1); assert(m.box()[1] == EVENT3); assert(m.box()[2] == STATEA_ENTRY);
+	assert(m.box()[3] == EVENT1); assert(m.box()[4] == EVENT2);
+
+	m->clear();
+	m.dispatchBatch(&events[0], &events[0] + events.size());
+	assert(m.box().size() == 7);
+	assert(m.box()[0] == EVENT1); assert(m.box()[1] == EVENT3); assert(m.box()[2] == STATEB_ENTRY);
+	assert(m.box()[3] == EVENT1); assert(m.box()[4] == EVENT3); assert(m.box()[5] == STATEA_ENTRY);
+	assert(m.box()[6] == EVENT1);
+	// Machines keep their own state data, also when one handles events of the
+	// other (state objects are shared with MACHO_FLYWEIGHT).
+	Macho::Machine<Top> other;
+	m->clear();
+	m->forward(&other);
+	assert(m.box().size() == 1); assert(m.box()[0] == EVENT2);
+	assert(other.box().size() == 1); assert(other.box()[0] == EVENT1);
 }
 
 
@@ -1182,6 +1586,29 @@ void testAliases() {
 	// Testing multiple parameters to state init method.
 	TestAccess::setState(m, Macho::State<StateC>(1, 2, 3, 4));
 	assert(StateC::alias() == m.currentState());
+	// Finding states by ID and name.
+	assert(Macho::Machine<Top>::findState(StateCAB::alias().id()) == StateCAB::key());
+	assert(Macho::Machine<Top>::findState("StateCAB") == StateCAB::key());
+	assert(Macho::Machine<Top>::findState("Top") == Top::key());
+	assert(Macho::Machine<Top>::findState("StateX") == StateX::key());
+	assert(Macho::Machine<Top>::findState("StateCA") != StateCAB::key());
+	assert(Macho::Machine<Top>::findState("NoState") == 0);
+	assert(Macho::Machine<Top>::findState("") == 0);
+	assert(Macho::Machine<Top>::findState(Macho::ID(0)) == 0);
+	assert(Macho::Machine<Top>::findState(Macho::ID(100000)) == 0);
+
+	// Restoring persisted state.
+	TestAccess::setState<StateX>(m);
+	std::string name = m.currentState().name();
+	Macho::ID id = m.currentState().id();
+
+	TestAccess::setState(m, Macho::State<StateC>(1, 2, 3, 4));
+	TestAccess::setState(m, Macho::Alias(Macho::Machine<Top>::findState(name.c_str())));
+	assert(StateX::alias() == m.currentState());
+
+	TestAccess::setState(m, Macho::State<StateC>(1, 2, 3, 4));
+	TestAccess::setState(m, Macho::Alias(Macho::Machine<Top>::findState(id)));
+	assert(StateX::alias() == m.currentState());
 }
 
 
@@ -1242,6 +1669,464 @@ void testTemplates() {
 
 	TestAccess::setStateHistory<TTop<Macho::Anchor<StateA, 0> > >(m);
 	assert(No0::alias() == m.currentState());
+
+	// Test reflection on template states
+	typedef TTop<Macho::Anchor<StateA, 0> > Top0;
+	typedef TTop<Macho::Anchor<StateA, 1> > Top1;
+
+	assert(No0::isCurrent(m));
+	assert(Top0::isCurrent(m));
+	assert(!Top1::isCurrent(m));
+	assert(StateA::isCurrent(m));
+	assert(Top::isCurrent(m));
+
+	assert(No0::isChild(Top0::alias()));
+	assert(!No0::isChild(Top1::alias()));
+	assert(No0::isChild(StateA::alias()));
+	assert(!No0::isChild(StateB::alias()));
+	assert(!StateA::isChild(No0::alias()));
+
+	assert(Top1::isParent(No1b::alias()));
+	assert(!Top0::isParent(No1b::alias()));
+	assert(Top::isParent(No1b::alias()));
+	assert(!No1b::isParent(Top1::alias()));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Testing event queue.
+#ifdef MACHO_THREADS
+static void produce(Macho::Machine<Queue::Top> * m, int producer, long first, long count) {
+	for (long i = first; i < first + count; ++i) {
+		Macho::IEvent<Queue::Top> * event = Macho::Event(&Queue::Top::event, producer, i);
+		while (!m->post(event))
+			std::this_thread::yield();
+	}
+}
+#endif
+
+static void countEvents(const Queue::Top::Box & box, long & count) {
+	count = box.count;
+}
+
+#ifdef MACHO_THREADS
+// Count and sequence of producer 0 change together.
+static void readBox(const Macho::PublishedBox<Queue::Top> * published, bool * consistent) {
+	Queue::Top::Box first = published->get();
+	Queue::Top::Box box = first;
+	while (box.last[0] < 19999) {
+		box = published->get();
+		*consistent = *consistent && box.count - first.count == box.last[0] - first.last[0];
+	}
+}
+#endif
+
+void testQueue() {
+	using namespace Queue;
+
+	Macho::Machine<Top> m;
+
+	// Events dispatched by a handler are executed in order.
+	m->burst();
+	assert(m.box().count == 3);
+	assert(m.box().last[0] == 2);
+
+	// Posted events wait for the machine.
+	assert(m.post(Event(&Top::event, 1, 0)));
+	assert(m.post(Event(&Top::event, 1, 1)));
+	assert(m.box().count == 3);
+
+	m.processQueue();
+	assert(m.box().count == 5);
+	assert(m.box().last[1] == 1);
+
+	// Queue is bounded: rejected event is still ours.
+	int posted = 0;
+	Macho::IEvent<Top> * event = Event(&Top::event, 2, 0);
+	while (m.post(event))
+		event = Event(&Top::event, 2, ++posted);
+	delete event;
+	assert(posted == MACHO_EVENT_QUEUE_SIZE);
+
+	// Posted events are processed after next event handled.
+	m->event(3, 0);
+	assert(m.box().count == 5 + 1 + posted);
+	assert(m.box().last[2] == posted - 1);
+	assert(m.box().ordered);
+
+	// Full queue does not refuse events dispatched by a handler.
+	long handled = m.box().count;
+	posted = 0;
+	event = Event(&Top::event, 2, m.box().last[2] + 1);
+	while (m.post(event))
+		event = Event(&Top::event, 2, m.box().last[2] + 1 + ++posted);
+	delete event;
+	m->burst();
+	assert(m.box().count == handled + 3 + posted);
+	assert(m.box().ordered);
+
+	// Memory of event objects is recycled.
+	Macho::PoolStatistics before = Macho::Machine<Top>::eventPoolStatistics();
+	m->burst();
+	Macho::PoolStatistics after = Macho::Machine<Top>::eventPoolStatistics();
+	assert(after.allocations == before.allocations + 3);
+	assert(after.reused == before.reused + 3);
+	assert(after.cached == before.cached);
+	assert(after.cachedBytes >= after.cached * sizeof(void *));
+
+#ifdef MACHO_SNAPSHOTS
+	// Events posted before a restore are dispatched to restored state.
+	{
+		Macho::Snapshot<Top> s(m);
+		long counted = m.box().count;
+		assert(m.post(Event(&Top::event, 1, m.box().last[1] + 1)));
+		m = s;
+		assert(m.box().count == counted + 1);
+		assert(m.box().ordered);
+	}
+#endif
+
+	// Box is published after each step, as is or projected.
+	{
+		Macho::PublishedBox<Top> published(m);
+		Top::Box box;
+		unsigned long publications = published.get(box);
+		assert(box.count == m.box().count);
+
+		m->event(3, 1);
+		assert(published.get(box) == publications + 1);
+		assert(box.count == m.box().count && box.last[3] == 1);
+	}
+	{
+		Macho::PublishedBox<Top, long> count(m, &countEvents);
+		m->event(3, 2);
+		assert(count.get() == m.box().count);
+	}
+
+#ifdef MACHO_THREADS
+	// Other threads read consistent copies of the box.
+	{
+		Macho::PublishedBox<Top> published(m);
+		bool consistent = true;
+		std::thread reader(readBox, &published, &consistent);
+		for (long i = m.box().last[0] + 1; i < 20000; ++i)
+			m->event(0, i);
+		reader.join();
+		assert(consistent);
+	}
+
+	// Several producers: each producer's events arrive in order.
+	const long count = 20000;
+	std::thread p1(produce, &m, 1, m.box().last[1] + 1, count);
+	std::thread p2(produce, &m, 2, m.box().last[2] + 1, count);
+	std::thread p3(produce, &m, 3, m.box().last[3] + 1, count);
+
+	long expected = m.box().count + 3 * count;
+	while (m.box().count < expected)
+		m.processQueue();
+
+	p1.join(); p2.join(); p3.join();
+	m.processQueue();
+
+	assert(m.box().count == expected);
+	assert(m.box().ordered);
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Testing initializers of parametrized transitions.
+void testInitializers() {
+	using namespace Initializers;
+
+	Macho::Machine<Top> m;
+
+	// Chain of transitions started from init methods.
+	m->countdown(10);
+	assert(m.box().sum == 10 + 9 + 8);
+	assert(Pung::isCurrent(m));
+	assert(TestAccess::placedInitializers(m) == 0);
+
+	m->countdown(3);
+	assert(m.box().sum == 27 + 3 + 2 + 1);
+	assert(Pung::isCurrent(m));
+	assert(TestAccess::placedInitializers(m) == 0);
+
+	// Large parameters still work.
+	m->large(7);
+	assert(m.box().sum == 33 + 7);
+	assert(Heavy::isCurrent(m));
+	assert(TestAccess::placedInitializers(m) == 0);
+
+	// Aliases carry their initializers through copies and assignment.
+	Macho::Alias ping = Macho::State<Ping>(5L);
+	Macho::Alias heavy = Macho::State<Heavy>(Large(9));
+	Macho::Alias copy(ping);
+	copy = heavy;
+	heavy = ping;
+
+	TestAccess::setState(m, copy);
+	assert(m.box().sum == 40 + 9);
+	assert(Heavy::isCurrent(m));
+
+	TestAccess::setState(m, heavy);
+	assert(m.box().sum == 49 + 5 + 4 + 3);
+	assert(Pung::isCurrent(m));
+	assert(TestAccess::placedInitializers(m) == 0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Testing machine pools.
+namespace Pool {
+	// Counts machines visited, checks for duplicates.
+	struct Members {
+		Members(const Macho::MachinePool<Top> & pool) : pool(&pool), count(0), valid(true) {}
+
+		void operator()(Macho::MachinePool<Top>::Handle h) {
+			valid = valid && pool->contains(h) && seen.insert(h).second;
+			++count;
+		}
+
+		const Macho::MachinePool<Top> * pool;
+		std::set<Macho::MachinePool<Top>::Handle> seen;
+		long count;
+		bool valid;
+	};
+}
+
+#ifdef MACHO_THREADS
+static void drive(Macho::Executor<Pool::Top> * executor, unsigned long first, bool tick) {
+	for (unsigned long key = first; key < 300; key += 2) {
+		executor->post(key, Macho::Event(&Pool::Top::start));
+		if (tick)
+			executor->post(key, Macho::Event(&Pool::Top::tick));
+	}
+}
+
+static void lookUp(const Macho::Machine<Pool::Top> * m, unsigned long first, bool * found) {
+	*found = TestAccess::hasInstance<Pool::Slow>(*m) && Macho::Machine<Pool::Top>::findState("Slow") == Pool::Slow::key();
+
+	// Watch published state until both events are handled.
+	Macho::ID state;
+	unsigned long last = first;
+	while (last < first + 2 || !Pool::Slow::isPublished(*m)) {
+		unsigned long step = m->publishedState(state);
+		*found = *found && step >= last && state >= Macho::StateID<Pool::Idle>::value;
+		*found = *found && Pool::Top::isPublished(*m);
+		last = step;
+		std::this_thread::yield();
+	}
+}
+
+void testExecutor() {
+	using namespace Pool;
+
+	// All states are there from the start: other threads may look them up
+	// (and watch published state) while the machine runs.
+	Macho::Machine<Top> m;
+	bool found = false;
+	Macho::ID state;
+	std::thread monitor(lookUp, &m, m.publishedState(state), &found);
+	m.dispatch(Macho::Event(&Top::start));
+	m.dispatch(Macho::Event(&Top::tick));
+	monitor.join();
+	assert(found);
+
+	Macho::Executor<Top> executor(3);
+	for (unsigned long key = 0; key < 300; ++key)
+		executor.add(key);
+	executor.wait();
+	assert(executor.count<Idle>() == 300);
+
+	// Events of a producer for a machine arrive in order.
+	std::thread p1(drive, &executor, 0, true);
+	std::thread p2(drive, &executor, 1, false);
+	p1.join();
+	p2.join();
+	executor.wait();
+
+	assert(executor.count<Running>() == 300);
+	assert(executor.count<Slow>() == 150);
+	assert(executor.count<Fast>() == 150);
+	assert(executor.shard(7) == 1);
+	assert(executor.handled(0) + executor.handled(1) + executor.handled(2) == 450);
+
+	for (unsigned long key = 0; key < 100; ++key)
+		executor.remove(key);
+	executor.wait();
+	assert(executor.count<Running>() == 200);
+	assert(executor.count<Top>() == 200);
+
+	// Messages for removed machines are dropped; count waits for them.
+	executor.post(0, Macho::Event(&Top::tick));
+	executor.remove(1);
+	assert(executor.count<Top>() == 200);
+
+	// Adding a key in use keeps its machine and deletes the box.
+	executor.add(150, new Top::Box);
+	assert(executor.count<Top>() == 200);
+	assert(executor.count<Running>() == 200);
+}
+#endif
+
+#ifdef MACHO_THREADS
+// Most events go to the first machine.
+static void produceSkewed(Macho::Scheduler<Queue::Top> * scheduler, Macho::Scheduler<Queue::Top>::Handle * machines, int producer, long count) {
+	long next[8] = { 0 };
+	for (long i = 0; i < count; ++i) {
+		int k = i % 4 ? 0 : (i / 4) % 8;
+		Macho::IEvent<Queue::Top> * event = Macho::Event(&Queue::Top::event, producer, next[k]++);
+		while (!scheduler->post(machines[k], event))
+			std::this_thread::yield();
+	}
+}
+
+void testScheduler() {
+	Macho::Scheduler<Queue::Top> scheduler(4);
+	Macho::Scheduler<Queue::Top>::Handle machines[8];
+	for (int i = 0; i < 8; ++i)
+		machines[i] = scheduler.add();
+
+	// Each machine gets its events in order, whoever runs it.
+	const long count = 20000;
+	std::thread p1(produceSkewed, &scheduler, machines, 1, count);
+	std::thread p2(produceSkewed, &scheduler, machines, 2, count);
+	p1.join();
+	p2.join();
+	scheduler.wait();
+
+	long events = 0;
+	for (int i = 0; i < 8; ++i) {
+		const Queue::Top::Box & box = scheduler.machine(machines[i]).box();
+		assert(box.ordered);
+		events += box.count;
+	}
+	assert(events == 2 * count);
+	assert(scheduler.machine(machines[0]).box().count == 2 * (count - count / 4) + 2 * (count / 32));
+
+	unsigned long runs = 0;
+	for (unsigned int w = 0; w < scheduler.threads(); ++w) {
+		Macho::Scheduler<Queue::Top>::Statistics statistics = scheduler.statistics(w);
+		assert(statistics.depth == 0);
+		assert(statistics.steals <= statistics.runs);
+		runs += statistics.runs;
+	}
+	assert(runs > 0);
+}
+#endif
+
+void testPool() {
+	using namespace Pool;
+
+	// Machines publish their state after each step.
+	Macho::Machine<Top> m;
+	Macho::ID state;
+	unsigned long steps = m.publishedState(state);
+	assert(state == Macho::StateID<Idle>::value);
+	m.dispatch(Event(&Top::start));
+	assert(m.publishedState(state) == steps + 1);
+	assert(state == Macho::StateID<Fast>::value);
+	assert(m.isPublished<Running>() && !m.isPublished<Idle>());
+	assert(Fast::isPublished(m) && !Slow::isPublished(m));
+
+	Macho::MachinePool<Top> pool;
+	Macho::MachinePool<Top>::Handle a = pool.add();
+	Macho::MachinePool<Top>::Handle b = pool.add(Macho::State<Running>());
+	assert(pool.size() == 2);
+	assert(pool.isCurrent<Idle>(a));
+	assert(pool.isCurrent<Fast>(b));
+	assert(pool.isCurrent<Running>(b));
+
+	// Per state a row holds box, box memory and history (as _HistoryID).
+	std::size_t states = TestAccess::stateCount<Top>();
+	assert(pool.rowSize() == sizeof(Macho::ID) + states * (2 * sizeof(void *) + sizeof(Macho::_HistoryID)) +
+		sizeof(Macho::MachinePool<Top>::Handle) + 2 * sizeof(unsigned long));
+
+	// Machines have their own state, boxes and history.
+	pool.dispatch(a, Event(&Top::start));
+	pool.dispatch(a, Event(&Top::tick));
+	assert(pool.isCurrent<Slow>(a));
+	assert(pool.isCurrent<Fast>(b));
+	assert(pool.box(a).ticks == 1);
+	assert(pool.box(b).ticks == 0);
+
+	pool.dispatch(a, Event(&Top::stop));
+	pool.dispatch(b, Event(&Top::stop));
+	pool.dispatch(a, Event(&Top::start));
+	pool.dispatch(b, Event(&Top::start));
+	assert(pool.currentState(a) == Slow::alias());
+	assert(pool.currentState(b) == Fast::alias());
+
+	// Events dispatched by handlers go to the same machine.
+	pool.dispatch(a, Event(&Top::tick));
+	assert(pool.isCurrent<Fast>(a));
+	assert(pool.box(a).ticks == 3);
+	assert(pool.box(b).ticks == 0);
+
+	// Handles of removed machines are reused.
+	pool.remove(a);
+	assert(!pool.contains(a));
+	assert(pool.size() == 1);
+	Macho::MachinePool<Top>::Handle c = pool.add(new Top::Box);
+	assert(c == a);
+	assert(pool.isCurrent<Idle>(c));
+	assert(pool.box(c).ticks == 0);
+
+	// History of a removed machine is gone.
+	pool.dispatch(c, Event(&Top::start));
+	assert(pool.isCurrent<Fast>(c));
+
+	// Pool grows.
+	std::vector<Macho::MachinePool<Top>::Handle> handles;
+	for (int i = 0; i < 1000; ++i) {
+		handles.push_back(pool.add());
+		pool.dispatch(handles.back(), Event(&Top::start));
+		for (int j = 0; j < i % 2; ++j)
+			pool.dispatch(handles.back(), Event(&Top::tick));
+	}
+
+	assert(pool.size() == 1002);
+	for (int i = 0; i < 1000; ++i) {
+		assert(pool.box(handles[i]).ticks == i % 2);
+		assert(i % 2 ? pool.isCurrent<Slow>(handles[i]) : pool.isCurrent<Fast>(handles[i]));
+	}
+	// Index of machines by state.
+	assert(pool.count<Top>() == 1002);
+	assert(pool.count<Running>() == 1002);
+	assert(pool.count<Slow>() == 500);
+	assert(pool.count<Fast>() == 502);
+	assert(pool.count<Idle>() == 0);
+
+	for (int i = 0; i < 1000; i += 4)
+		pool.dispatch(handles[i], Event(&Top::stop));
+	pool.remove(handles[1]);
+	pool.remove(handles[2]);
+	assert(pool.count<Idle>() == 250);
+	assert(pool.count<Slow>() == 499);
+	assert(pool.count<Fast>() == 251);
+	assert(pool.count(Top::key()) == 1000);
+
+	Members idle = pool.members<Idle>(Members(pool));
+	assert(idle.count == 250);
+	assert(idle.valid);
+
+	Members running = pool.members<Running>(Members(pool));
+	assert(running.count == 750);
+	assert(running.valid);
+	// Broadcast reaches machines in state when broadcast starts, once.
+	assert(pool.broadcast<Idle>(Event(&Top::start)) == 250);
+	assert(pool.count<Idle>() == 0);
+	assert(pool.count<Running>() == 1000);
+
+	assert(pool.broadcast<Fast>(Event(&Top::tick)) == 501);
+	assert(pool.count<Fast>() == 0);
+	assert(pool.count<Slow>() == 1000);
+
+	Macho::InlineEvent<Top> stop(&Top::stop);
+	assert(pool.broadcast<Running>(stop) == 1000);
+	assert(pool.broadcast<Running>(stop) == 0);
+	assert(pool.count<Idle>() == 1000);
 }
 
 
@@ -1260,6 +2145,23 @@ int main() {
 	cout << endl << "Testing template states" << endl;
 	testTemplates();
 
+	cout << endl << "Testing event queue" << endl;
+	testQueue();
+
+	cout << endl << "Testing initializers" << endl;
+	testInitializers();
+
+	cout << endl << "Testing machine pools" << endl;
+	testPool();
+
+#ifdef MACHO_THREADS
+	cout << endl << "Testing executor" << endl;
+	testExecutor();
+
+	cout << endl << "Testing scheduler" << endl;
+	testScheduler();
+#endif
+
 	cout << endl << "-- Test complete ---" << endl;
 	return 0;
 }